@@ -1,13 +1,20 @@
 #ifndef BASE_H
 #define BASE_H
 
+#include <algorithm>
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 
 //#define TAPERED 1
 
+// Set by the TUNER_SINGLE_PRECISION CMake option
+#if TUNER_SINGLE_PRECISION
+using tune_t = float;
+#else
 using tune_t = double;
+#endif
 
 #if TAPERED
 using pair_t = std::array<tune_t, 2>;
@@ -25,6 +32,72 @@ struct EvalResult
     tune_t endgame_scale = 1;
 };
 
+// Sparse alternative to building a dense coefficients_t. The eval reports each term it touches with add(),
+// repeated indices accumulate, and the tuner collects the non-zero terms once the eval is done.
+// The tuner keeps one sink per thread, sized to the parameter count
+class TraceSink
+{
+public:
+    void resize(const size_t parameter_count)
+    {
+        values.assign(parameter_count, 0);
+        touched.clear();
+    }
+
+    size_t size() const
+    {
+        return values.size();
+    }
+
+    void add(const int32_t parameter_index, const int32_t white_count, const int32_t black_count)
+    {
+        const auto count = white_count - black_count;
+        if (count == 0)
+        {
+            return;
+        }
+
+        auto& value = values[parameter_index];
+        if (value == 0)
+        {
+            touched.push_back(parameter_index);
+        }
+        value += count;
+    }
+
+    // Calls emit(parameter_index, value) for every non-zero term in index order and resets the sink
+    template<typename F>
+    void drain(F&& emit)
+    {
+        std::sort(touched.begin(), touched.end());
+        touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+        for (const auto parameter_index : touched)
+        {
+            auto& value = values[parameter_index];
+            if (value != 0)
+            {
+                emit(parameter_index, value);
+                value = 0;
+            }
+        }
+        touched.clear();
+    }
+
+    // Dense fallback for callers that still need a full coefficients_t
+    void drain(coefficients_t& coefficients)
+    {
+        coefficients.assign(values.size(), 0);
+        drain([&coefficients](const int32_t parameter_index, const int32_t value)
+        {
+            coefficients[parameter_index] = static_cast<int16_t>(value);
+        });
+    }
+
+private:
+    std::vector<int32_t> values;
+    std::vector<int32_t> touched;
+};
+
 #if TAPERED
 enum class PhaseStages
 {
@@ -0,0 +1,79 @@
+#ifndef BATCH_QUEUE_H
+#define BATCH_QUEUE_H 1
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <queue>
+
+// Bounded multi-producer multi-consumer queue. push() blocks while the queue is full, so producers
+// can never run further ahead of the consumers than the queue capacity.
+template<typename T>
+class BatchQueue {
+public:
+    explicit BatchQueue(size_t capacity) : capacity(capacity) {}
+
+    // Returns false when the queue was closed, consumers can close it to stop their producers early
+    bool push(T&& item)
+    {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            not_full.wait(lock, [this]
+            {
+                return items.size() < capacity || closed;
+            });
+
+            if (closed)
+            {
+                return false;
+            }
+
+            items.push(std::move(item));
+        }
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue is closed and drained
+    bool pop(T& item)
+    {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            not_empty.wait(lock, [this]
+            {
+                return !items.empty() || closed;
+            });
+
+            if (items.empty())
+            {
+                return false;
+            }
+
+            item = std::move(items.front());
+            items.pop();
+        }
+        not_full.notify_one();
+        return true;
+    }
+
+    // Signals that no more items will be pushed
+    void close()
+    {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            closed = true;
+        }
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    bool closed = false;
+    std::mutex queue_mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::queue<T> items;
+};
+
+#endif // !BATCH_QUEUE_H
@@ -20,6 +20,16 @@ constexpr int32_t data_load_thread_count = 8;
 constexpr int32_t thread_count = 8;
 constexpr static bool print_data_entries = false;
 constexpr static int32_t data_load_print_interval = 10000;
+constexpr static bool use_data_cache = false;
+constexpr static const char* data_cache_directory = ".";
+constexpr static bool compress_coefficients = false;
+constexpr static bool merge_duplicate_entries = true;
+constexpr static bool deduplicate_positions = false;
+constexpr static uint64_t sampling_seed = 0x5EED;
+constexpr static int32_t sampling_phase_buckets = 5;
+constexpr static bool use_line_index = false;
+constexpr static int32_t pgn_skip_plies = 8;
+constexpr static int32_t pgn_positions_per_game = 0;
 
 
 #endif // !CONFIG_H
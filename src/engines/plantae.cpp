@@ -9,22 +9,26 @@ using namespace std;
 using namespace Plantae;
 
 
-struct Trace
+// Parameter layout, every term is reported straight to the trace sink instead of a dense trace
+// One psqt for each piece for every king square - helps with king safety
+// [piece][kingsq (^56 for white)][sq (^56 for white)]
+constexpr int32_t king_rel_psqt_offset = 0;
+constexpr int32_t king_psqt_offset = king_rel_psqt_offset + 5 * 64 * 64;
+
+// Score for piece mobility
+// Better to attack more squares
+// [piece][attacks]
+constexpr int32_t mobilities_offset = king_psqt_offset + 64;
+
+// Piece attacking queen Bonus
+// [piece][queen square]
+constexpr int32_t piece_attack_queen_offset = mobilities_offset + 4 * 28;
+constexpr int32_t parameter_count = piece_attack_queen_offset + 5 * 64;
+
+static void add_term(TraceSink& sink, const int32_t parameter_index, const bool isWhite)
 {
-    // One psqt for each piece for every king square - helps with king safety
-    // [piece][kingsq (^56 for white)][sq (^56 for white)][color]
-    int32_t king_rel_psqt[5][64][64][2]{};
-    int32_t king_psqt[64][2]{};
-
-    // Score for piece mobility
-    // Better to attack more squares
-    // [piece][attacks][color]
-    int32_t mobilities[4][28][2]{};
-
-    // Piece attacking queen Bonus
-    // [piece][king square][color]
-    int32_t piece_attack_queen[5][64][2];
-};
+    sink.add(parameter_index, isWhite ? 1 : 0, isWhite ? 0 : 1);
+}
 
 // S(mg,eg) 
 constexpr array<array<array<int32_t, 64>, 64>, 5> king_rel_psqt{};
@@ -35,8 +39,7 @@ constexpr array<array<int32_t, 64>,5> piece_attack_queen{};
 static int gamePhaseInc[] = { 0, 1, 1, 2, 4, 0 };
 
 
-static Trace trace_evaluate_extern(const chess::Board& board) {
-    Trace trace{};
+static void trace_evaluate_extern(const chess::Board& board, TraceSink& sink) {
 
     int whiteKingSq = board.kingSq(chess::Color::WHITE).index();
     int blackKingSq = board.kingSq(chess::Color::BLACK).index();
@@ -73,7 +76,7 @@ static Trace trace_evaluate_extern(const chess::Board& board) {
             // < kings
             if (j < 5) {
                 //PST
-                trace.king_rel_psqt[j][isWhite ? whiteKingSq ^ 56 : blackKingSq][sq ^ (isWhite ? 56 : 0)][isWhite ? 0 : 1]++;
+                add_term(sink, king_rel_psqt_offset + (j * 64 + (isWhite ? whiteKingSq ^ 56 : blackKingSq)) * 64 + (sq ^ (isWhite ? 56 : 0)), isWhite);
                 
                 // Piece Attack Queen
                 bool attackQueen = false;
@@ -106,11 +109,11 @@ static Trace trace_evaluate_extern(const chess::Board& board) {
                             break;
                     }
                 }
-                if (attackQueen) trace.piece_attack_queen[j][isWhite ? blackQueenSq ^ 56 : whiteQueenSq][isWhite ? 0 : 1]++;
+                if (attackQueen) add_term(sink, piece_attack_queen_offset + j * 64 + (isWhite ? blackQueenSq ^ 56 : whiteQueenSq), isWhite);
             }
             else {
                 // PST
-                trace.king_psqt[isWhite ? sq ^ 56 : sq][isWhite ? 0 : 1]++;
+                add_term(sink, king_psqt_offset + (isWhite ? sq ^ 56 : sq), isWhite);
             }
 
 
@@ -139,44 +142,15 @@ static Trace trace_evaluate_extern(const chess::Board& board) {
                     default:
                         break;
                 }
-                trace.mobilities[j-1][attacks][isWhite ? 0 : 1]++;
+                add_term(sink, mobilities_offset + (j - 1) * 28 + attacks, isWhite);
             }
                 
         }
 
     }
-
-    return trace;
 }
 
 
-static coefficients_t get_coefficients(const Trace& trace)
-{
-    coefficients_t coefficients;
-    
-    // King-Relatie PST
-    for (int i = 0; i < 5; i++){
-        for (int j = 0; j < 64; j++){
-            get_coefficient_array(coefficients, trace.king_rel_psqt[i][j], 64);
-        }
-    }
-    // King PST
-    get_coefficient_array(coefficients, trace.king_psqt, 64);
-
-    // Mobilities
-    for (int i = 0; i < 4; i++) {
-        get_coefficient_array(coefficients, trace.mobilities[i], 28);
-    }
-
-    // Piece Attack King
-    for (int i = 0; i < 5; i++){
-        get_coefficient_array(coefficients, trace.piece_attack_queen[i], 64);
-    }
-
-
-    return coefficients;
-}
-
 parameters_t PlantaeEval::get_initial_parameters()
 {
     parameters_t parameters;
@@ -211,12 +185,20 @@ EvalResult PlantaeEval::get_fen_eval_result(const string& fen)
 
 EvalResult PlantaeEval::get_external_eval_result(const chess::Board& board)
 {
-    auto trace = trace_evaluate_extern(board);
+    TraceSink sink;
+    sink.resize(parameter_count);
+    trace_evaluate_extern(board, sink);
     EvalResult result;
-    result.coefficients = get_coefficients(trace);
+    sink.drain(result.coefficients);
     return result;
 }
 
+EvalResult PlantaeEval::get_external_sparse_eval_result(const chess::Board& board, TraceSink& sink)
+{
+    trace_evaluate_extern(board, sink);
+    return EvalResult();
+}
+
 static void print_parameter(std::stringstream& ss, const pair_t parameter)
 {
     ss << "S(" << parameter[static_cast<int32_t>(PhaseStages::Midgame)] << ", " << parameter[static_cast<int32_t>(PhaseStages::Endgame)] << ")";
@@ -30,6 +30,7 @@ namespace Plantae
         static parameters_t get_initial_parameters();
         static EvalResult get_fen_eval_result(const std::string& fen);
         static EvalResult get_external_eval_result(const chess::Board& board);
+        static EvalResult get_external_sparse_eval_result(const chess::Board& board, TraceSink& sink);
         static void print_parameters(const parameters_t& parameters);
     };
 }
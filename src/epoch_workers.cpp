@@ -0,0 +1,94 @@
+#include "epoch_workers.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#define CPU_PAUSE() _mm_pause()
+#else
+#define CPU_PAUSE() std::this_thread::yield()
+#endif
+
+using namespace std;
+
+SpinBarrier::SpinBarrier(const uint32_t count) : count(count)
+{
+}
+
+void SpinBarrier::arrive_and_wait()
+{
+    const auto current_generation = generation.load(memory_order_acquire);
+    if (arrived.fetch_add(1, memory_order_acq_rel) + 1 == count)
+    {
+        arrived.store(0, memory_order_relaxed);
+        generation.fetch_add(1, memory_order_release);
+        generation.notify_all();
+        return;
+    }
+
+    constexpr int32_t spin_count = 4096;
+    for (int32_t spin = 0; spin < spin_count; spin++)
+    {
+        if (generation.load(memory_order_acquire) != current_generation)
+        {
+            return;
+        }
+        CPU_PAUSE();
+    }
+
+    while (generation.load(memory_order_acquire) == current_generation)
+    {
+        generation.wait(current_generation, memory_order_acquire);
+    }
+}
+
+// The calling thread takes part in both barriers, so it is released exactly when the workers are done
+EpochWorkers::EpochWorkers(const uint32_t thread_count) : start_barrier(thread_count + 1), end_barrier(thread_count + 1), worker_barrier(thread_count)
+{
+    for (uint32_t thread_id = 0; thread_id < thread_count; thread_id++)
+    {
+        threads.emplace_back([this, thread_id]()
+        {
+            thread_loop(thread_id);
+        });
+    }
+}
+
+EpochWorkers::~EpochWorkers()
+{
+    should_stop = true;
+    start_barrier.arrive_and_wait();
+    for (thread& worker : threads)
+    {
+        worker.join();
+    }
+}
+
+uint32_t EpochWorkers::thread_count() const
+{
+    return static_cast<uint32_t>(threads.size());
+}
+
+void EpochWorkers::sync()
+{
+    worker_barrier.arrive_and_wait();
+}
+
+void EpochWorkers::dispatch()
+{
+    start_barrier.arrive_and_wait();
+    end_barrier.arrive_and_wait();
+}
+
+void EpochWorkers::thread_loop(const uint32_t thread_id)
+{
+    while (true)
+    {
+        start_barrier.arrive_and_wait();
+        if (should_stop)
+        {
+            return;
+        }
+
+        job_invoke(job_context, thread_id);
+        end_barrier.arrive_and_wait();
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef EPOCH_WORKERS_H
+#define EPOCH_WORKERS_H 1
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Reusable barrier for a fixed number of threads. Waiters spin briefly, then sleep on the atomic (a futex on Linux)
+class SpinBarrier {
+public:
+    explicit SpinBarrier(uint32_t count);
+    void arrive_and_wait();
+
+private:
+    const uint32_t count;
+    std::atomic<uint32_t> arrived = 0;
+    std::atomic<uint32_t> generation = 0;
+};
+
+// Long-lived worker threads for the epoch loop. run() hands the same job to every worker and returns once all of them
+// have finished it, without allocating or going through a shared job queue
+class EpochWorkers {
+public:
+    EpochWorkers(uint32_t thread_count);
+    ~EpochWorkers();
+    EpochWorkers(const EpochWorkers&) = delete;
+    EpochWorkers& operator=(const EpochWorkers&) = delete;
+
+    uint32_t thread_count() const;
+
+    // job is called as job(thread_id) on every worker
+    template<typename F>
+    void run(F& job)
+    {
+        job_context = &job;
+        job_invoke = [](void* context, const uint32_t thread_id)
+        {
+            (*static_cast<F*>(context))(thread_id);
+        };
+        dispatch();
+    }
+
+    // Waits until every worker has reached this point, only valid from inside a job
+    void sync();
+
+private:
+    bool should_stop = false;
+    void* job_context = nullptr;
+    void (*job_invoke)(void*, uint32_t) = nullptr;
+    SpinBarrier start_barrier;
+    SpinBarrier end_barrier;
+    SpinBarrier worker_barrier;
+    std::vector<std::thread> threads;
+
+    void dispatch();
+    void thread_loop(uint32_t thread_id);
+};
+
+#endif // !EPOCH_WORKERS_H
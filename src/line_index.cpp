@@ -0,0 +1,168 @@
+#include "line_index.h"
+
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+using namespace std;
+
+struct LineIndexHeader
+{
+    array<char, 8> magic;
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t source_size;
+    int64_t source_write_time;
+    uint64_t line_count;
+};
+
+static constexpr array<char, 8> line_index_magic = { 'L', 'I', 'N', 'E', 'I', 'D', 'X', '1' };
+static constexpr uint32_t line_index_version = 1;
+
+// Newlines are counted in chunks this large, big enough that a chunk costs far more than claiming it
+static constexpr size_t line_index_chunk_size = 16 << 20;
+
+static int64_t get_write_time(const string& path)
+{
+    error_code error;
+    const auto write_time = filesystem::last_write_time(path, error);
+    return error ? 0 : static_cast<int64_t>(write_time.time_since_epoch().count());
+}
+
+bool LineIndex::load(const string& index_path, const string& source_path, const MappedFile& file)
+{
+    MappedFile index_file;
+    if (!index_file.open(index_path) || index_file.size() < sizeof(LineIndexHeader))
+    {
+        return false;
+    }
+
+    LineIndexHeader header;
+    memcpy(&header, index_file.data(), sizeof(header));
+    if (header.magic != line_index_magic || header.version != line_index_version
+        || header.source_size != file.size() || header.source_write_time != get_write_time(source_path)
+        || index_file.size() != sizeof(header) + (header.line_count + 1) * sizeof(uint64_t))
+    {
+        return false;
+    }
+
+    offsets.resize(header.line_count + 1);
+    memcpy(offsets.data(), index_file.data() + sizeof(header), offsets.size() * sizeof(uint64_t));
+    source_size = header.source_size;
+    source_write_time = header.source_write_time;
+    return true;
+}
+
+void LineIndex::build(ThreadPool& thread_pool, const string& source_path, const MappedFile& file)
+{
+    source_size = file.size();
+    source_write_time = get_write_time(source_path);
+
+    // First pass counts the newlines of every chunk, the second writes each chunk's line starts at its prefix sum
+    const char* const data = file.data();
+    const size_t size = file.size();
+    const auto chunk_count = (size + line_index_chunk_size - 1) / line_index_chunk_size;
+    vector<size_t> chunk_line_counts(chunk_count + 1, 0);
+    thread_pool.parallel_for(0, size, line_index_chunk_size, [data, &chunk_line_counts](const size_t start, const size_t end, const uint32_t)
+    {
+        size_t count = 0;
+        const char* cursor = data + start;
+        const char* const chunk_end = data + end;
+        while ((cursor = static_cast<const char*>(memchr(cursor, '\n', chunk_end - cursor))) != nullptr)
+        {
+            count++;
+            cursor++;
+        }
+        chunk_line_counts[start / line_index_chunk_size + 1] = count;
+    });
+    for (size_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        chunk_line_counts[chunk + 1] += chunk_line_counts[chunk];
+    }
+
+    // Line i starts after newline i - 1, so the start of the first line comes in front of them
+    offsets.resize(chunk_line_counts.back() + 2);
+    offsets[0] = 0;
+    thread_pool.parallel_for(0, size, line_index_chunk_size, [this, data, &chunk_line_counts](const size_t start, const size_t end, const uint32_t)
+    {
+        auto line = chunk_line_counts[start / line_index_chunk_size] + 1;
+        const char* cursor = data + start;
+        const char* const chunk_end = data + end;
+        while ((cursor = static_cast<const char*>(memchr(cursor, '\n', chunk_end - cursor))) != nullptr)
+        {
+            cursor++;
+            offsets[line++] = static_cast<uint64_t>(cursor - data);
+        }
+    });
+
+    // A final newline does not start another line, a missing one still ends the last line
+    auto line_count = chunk_line_counts.back() + 1;
+    if (size == 0 || data[size - 1] == '\n')
+    {
+        line_count--;
+        offsets.resize(line_count + 1);
+    }
+    else
+    {
+        offsets.back() = size + 1;
+    }
+
+    // Cut everything from the first empty line on, its start is the end of the line before it
+    for (size_t i = 0; i < line_count; i++)
+    {
+        if (line(file, i).empty())
+        {
+            offsets.resize(i + 1);
+            break;
+        }
+    }
+}
+
+bool LineIndex::save(const string& index_path) const
+{
+    LineIndexHeader header;
+    header.magic = line_index_magic;
+    header.version = line_index_version;
+    header.reserved = 0;
+    header.source_size = source_size;
+    header.source_write_time = source_write_time;
+    header.line_count = size();
+
+    // Same temporary name scheme as the data cache, an interrupted run never leaves a truncated index behind
+    const auto temporary_path = index_path + ".tmp";
+    {
+        ofstream file(temporary_path, ios::binary | ios::trunc);
+        if (!file)
+        {
+            return false;
+        }
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(offsets.data()), static_cast<streamsize>(offsets.size() * sizeof(uint64_t)));
+        if (!file)
+        {
+            return false;
+        }
+    }
+
+    remove(index_path.c_str());
+    return rename(temporary_path.c_str(), index_path.c_str()) == 0;
+}
+
+size_t LineIndex::size() const
+{
+    return offsets.empty() ? 0 : offsets.size() - 1;
+}
+
+string_view LineIndex::line(const MappedFile& file, const size_t index) const
+{
+    const auto start = offsets[index];
+    // One past the terminator, so the newline (or the end of the file) sits right before the next start
+    auto line = string_view(file.data() + start, offsets[index + 1] - 1 - start);
+    if (line.ends_with('\r'))
+    {
+        line.remove_suffix(1);
+    }
+    return line;
+}
@@ -0,0 +1,31 @@
+#ifndef LINE_INDEX_H
+#define LINE_INDEX_H 1
+
+#include "mapped_file.h"
+#include "threadpool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Byte offsets of the lines of a text file, saved next to it as a sidecar file. Lines end at the first empty line,
+// like the data source readers do. An index is only loaded back while the file's size and write time still match
+class LineIndex {
+public:
+    bool load(const std::string& index_path, const std::string& source_path, const MappedFile& file);
+    void build(ThreadPool& thread_pool, const std::string& source_path, const MappedFile& file);
+    bool save(const std::string& index_path) const;
+
+    size_t size() const;
+    std::string_view line(const MappedFile& file, size_t index) const;
+
+private:
+    // Start of every line, followed by one past the end of the last line's terminator
+    std::vector<uint64_t> offsets;
+    uint64_t source_size = 0;
+    int64_t source_write_time = 0;
+};
+
+#endif // !LINE_INDEX_H
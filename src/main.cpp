@@ -10,12 +10,21 @@ using namespace std;
 using namespace Tuner;
 
 int main(int argc, char** argv) {
+    if (argc > 1 && string(argv[1]) == "--self-check")
+    {
+        return self_check() ? 0 : 1;
+    }
+
+    // --benchmark sources.csv [result path] [reference path]
+    const bool benchmark = argc > 1 && string(argv[1]) == "--benchmark";
+    const int first_argument = benchmark ? 2 : 1;
+
     vector<DataSource> sources;
     {
         string csv_path = "sources.csv";
-        if (argc > 1)
+        if (argc > first_argument)
         {
-            csv_path = argv[1];
+            csv_path = argv[first_argument];
         }
         ifstream csv(csv_path);
         if(!csv)
@@ -73,6 +82,26 @@ int main(int argc, char** argv) {
                 return -1;
             }
 
+            // Optional, defaults to the first position_limit lines
+            string sampling_str;
+            if (getline(ss, sampling_str, ','))
+            {
+                try
+                {
+                    const auto sampling = stoul(sampling_str);
+                    if (sampling > static_cast<unsigned long>(SamplingMode::PhaseBalanced))
+                    {
+                        throw std::invalid_argument(sampling_str);
+                    }
+                    source.sampling = static_cast<SamplingMode>(sampling);
+                }
+                catch (const std::invalid_argument&)
+                {
+                    cout << sampling_str << " is not a valid sampling mode";
+                    return -1;
+                }
+            }
+
             sources.push_back(source);
         }
     }
@@ -83,6 +112,14 @@ int main(int argc, char** argv) {
         return -1;
     }
 
+    if (benchmark)
+    {
+        const string result_path = argc > first_argument + 1 ? argv[first_argument + 1] : "benchmark.txt";
+        const string reference_path = argc > first_argument + 2 ? argv[first_argument + 2] : "";
+        Tuner::benchmark(sources, result_path, reference_path);
+        return 0;
+    }
+
     run(sources);
 
     return 0;
@@ -0,0 +1,157 @@
+#include "mapped_file.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+#if defined(_WIN32)
+bool MappedFile::open(const string& path)
+{
+    close();
+
+    const auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size))
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    file_handle = file;
+    opened = true;
+    mapped_size = static_cast<size_t>(file_size.QuadPart);
+    if (mapped_size == 0)
+    {
+        return true;
+    }
+
+    mapping_handle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_handle == nullptr)
+    {
+        close();
+        return false;
+    }
+
+    mapped_data = static_cast<const char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+    if (mapped_data == nullptr)
+    {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mapped_data != nullptr)
+    {
+        UnmapViewOfFile(mapped_data);
+    }
+    if (mapping_handle != nullptr)
+    {
+        CloseHandle(mapping_handle);
+    }
+    if (file_handle != nullptr)
+    {
+        CloseHandle(file_handle);
+    }
+
+    mapped_data = nullptr;
+    mapping_handle = nullptr;
+    file_handle = nullptr;
+    mapped_size = 0;
+    opened = false;
+}
+#else
+bool MappedFile::open(const string& path)
+{
+    close();
+
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    opened = true;
+    mapped_size = static_cast<size_t>(file_stat.st_size);
+    if (mapped_size == 0)
+    {
+        ::close(fd);
+        return true;
+    }
+
+    void* mapping = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        mapped_size = 0;
+        opened = false;
+        return false;
+    }
+
+    madvise(mapping, mapped_size, MADV_SEQUENTIAL);
+    mapped_data = static_cast<const char*>(mapping);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mapped_data != nullptr)
+    {
+        munmap(const_cast<char*>(mapped_data), mapped_size);
+    }
+
+    mapped_data = nullptr;
+    mapped_size = 0;
+    opened = false;
+}
+#endif
+
+bool MappedFile::is_open() const
+{
+    return opened;
+}
+
+const char* MappedFile::data() const
+{
+    return mapped_data;
+}
+
+size_t MappedFile::size() const
+{
+    return mapped_size;
+}
+
+string_view MappedFile::view() const
+{
+    return string_view(mapped_data, mapped_size);
+}
@@ -0,0 +1,34 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H 1
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Read-only memory mapping of a whole file. The mapping stays valid until close() or destruction,
+// so string_views into view() can be handed out to other threads for as long as the MappedFile lives.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+    bool is_open() const;
+    const char* data() const;
+    size_t size() const;
+    std::string_view view() const;
+
+private:
+    const char* mapped_data = nullptr;
+    size_t mapped_size = 0;
+    bool opened = false;
+#if defined(_WIN32)
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+#endif
+};
+
+#endif // !MAPPED_FILE_H
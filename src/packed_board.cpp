@@ -0,0 +1,125 @@
+#include "packed_board.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+static constexpr uint8_t packed_castling_rook = 6;
+static constexpr uint8_t packed_no_square = 64;
+
+bool PackedBoard::is_packed(const string& path)
+{
+    return path.ends_with(".bin");
+}
+
+static uint64_t read_u64(const char* data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint8_t get_piece_nibble(const string_view record, const int32_t index)
+{
+    const auto byte = static_cast<uint8_t>(record[8 + index / 2]);
+    return index % 2 == 0 ? byte & 0xF : byte >> 4;
+}
+
+int32_t PackedBoard::get_phase(const string_view record)
+{
+    constexpr array<int32_t, 7> phase_increments = { 0, 1, 1, 2, 4, 0, 2 };
+    const auto piece_count = min(popcount(read_u64(record.data())), 32);
+    int32_t phase = 0;
+    for (int32_t i = 0; i < piece_count; i++)
+    {
+        const auto type = get_piece_nibble(record, i) & 7;
+        if (type <= packed_castling_rook)
+        {
+            phase += phase_increments[type];
+        }
+    }
+    return min(phase, 24);
+}
+
+float PackedBoard::set_packed(const string_view record)
+{
+    if (record.size() != record_size)
+    {
+        throw runtime_error("Packed board record has the wrong size");
+    }
+
+    occ_bb_.fill(0ULL);
+    pieces_bb_.fill(0ULL);
+    board_.fill(chess::Piece::NONE);
+    cr_.clear();
+    prev_states_.clear();
+
+    auto occupancy = read_u64(record.data());
+    if (popcount(occupancy) > 32)
+    {
+        throw runtime_error("Packed board has too many pieces");
+    }
+
+    array<chess::Square, 4> castling_rooks;
+    int32_t castling_rook_count = 0;
+    int32_t piece_index = 0;
+    while (occupancy != 0)
+    {
+        const auto square = chess::Square(countr_zero(occupancy));
+        occupancy &= occupancy - 1;
+        const auto nibble = get_piece_nibble(record, piece_index++);
+        auto type = nibble & 7;
+        const auto color = nibble >> 3;
+        if (type == packed_castling_rook)
+        {
+            if (castling_rook_count == static_cast<int32_t>(castling_rooks.size()))
+            {
+                throw runtime_error("Packed board has too many castling rooks");
+            }
+            castling_rooks[castling_rook_count++] = square;
+            type = static_cast<uint8_t>(static_cast<int>(chess::PieceType::ROOK));
+        }
+        else if (type > 5)
+        {
+            throw runtime_error("Packed board has an invalid piece");
+        }
+        placePiece(chess::Piece(static_cast<chess::Piece::underlying>(color * 6 + type)), square);
+    }
+
+    if (pieces(chess::PieceType::KING, chess::Color::WHITE).count() != 1 || pieces(chess::PieceType::KING, chess::Color::BLACK).count() != 1)
+    {
+        throw runtime_error("Packed board needs one king per side");
+    }
+
+    // The side of a castling rook follows from where it stands relative to its own king
+    for (int32_t i = 0; i < castling_rook_count; i++)
+    {
+        const auto rook = castling_rooks[i];
+        const auto color = at(rook).color();
+        const auto side = CastlingRights::closestSide(rook.file(), kingSq(color).file());
+        cr_.setCastlingRight(color, side, rook.file());
+    }
+
+    const auto stm_ep_square = static_cast<uint8_t>(record[24]);
+    stm_ = (stm_ep_square & 0x80) != 0 ? chess::Color::BLACK : chess::Color::WHITE;
+    const auto ep_square = stm_ep_square & 0x7F;
+    ep_sq_ = ep_square < packed_no_square ? chess::Square(ep_square) : chess::Square(chess::Square::underlying::NO_SQ);
+
+    hfm_ = static_cast<uint8_t>(record[25]);
+    uint16_t fullmove_number;
+    memcpy(&fullmove_number, record.data() + 26, sizeof(fullmove_number));
+    plies_ = static_cast<uint16_t>(max(fullmove_number, static_cast<uint16_t>(1)) * 2 - 2 + (stm_ == chess::Color::BLACK ? 1 : 0));
+
+    key_ = zobrist();
+
+    const auto wdl = static_cast<uint8_t>(record[30]);
+    if (wdl > 2)
+    {
+        throw runtime_error("Packed board has an invalid wdl");
+    }
+    return static_cast<float>(wdl) / 2;
+}
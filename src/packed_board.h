@@ -0,0 +1,29 @@
+#ifndef PACKED_BOARD_H
+#define PACKED_BOARD_H 1
+
+#include "external/chess.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Board read straight from a 32 byte marlinformat record, without going through a FEN:
+//   uint64 occupancy, 32 x 4 bit pieces in occupancy order, uint8 side to move (bit 7) and en passant square,
+//   uint8 halfmove clock, uint16 fullmove number, int16 eval, uint8 wdl (0 black win, 1 draw, 2 white win), uint8 unused
+// Piece nibbles hold the type in the low 3 bits (6 is a rook that can still castle) and the color in bit 3.
+class PackedBoard : public chess::Board {
+public:
+    static constexpr size_t record_size = 32;
+
+    // Whether the data source holds packed boards, picked by the .bin extension
+    static bool is_packed(const std::string& path);
+
+    // Game phase of a record, counted without decoding the board
+    static int32_t get_phase(std::string_view record);
+
+    // Replaces the board with the record, returns the record's wdl from white's side
+    float set_packed(std::string_view record);
+};
+
+#endif // !PACKED_BOARD_H
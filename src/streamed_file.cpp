@@ -0,0 +1,312 @@
+#include "streamed_file.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+
+#if TUNER_ZLIB
+#include <zlib.h>
+#endif
+
+#if TUNER_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+// Bytes per block, a line longer than this grows the block until it fits
+static constexpr size_t stream_block_size = 4 << 20;
+static constexpr size_t stream_queue_capacity = 4;
+
+class StreamDecoder {
+public:
+    virtual ~StreamDecoder() = default;
+
+    // Reads up to capacity bytes, returns 0 at the end of the file and -1 on errors
+    virtual int64_t read(char* output, size_t capacity) = 0;
+};
+
+// Uncompressed pipes, the decoder only closes what it opened itself
+class PipeDecoder : public StreamDecoder {
+public:
+    PipeDecoder(FILE* file, const bool owns_file) : file(file), owns_file(owns_file)
+    {
+    }
+
+    ~PipeDecoder() override
+    {
+        if (owns_file)
+        {
+            fclose(file);
+        }
+    }
+
+    int64_t read(char* output, const size_t capacity) override
+    {
+        const auto read_size = fread(output, 1, capacity, file);
+        if (read_size == 0 && ferror(file))
+        {
+            return -1;
+        }
+        return static_cast<int64_t>(read_size);
+    }
+
+private:
+    FILE* file;
+    const bool owns_file;
+};
+
+#if TUNER_ZLIB
+// gzread also takes care of concatenated gzip members
+class GzipDecoder : public StreamDecoder {
+public:
+    explicit GzipDecoder(gzFile file) : file(file)
+    {
+        gzbuffer(file, 1 << 18);
+    }
+
+    ~GzipDecoder() override
+    {
+        gzclose(file);
+    }
+
+    int64_t read(char* output, const size_t capacity) override
+    {
+        const auto read_size = gzread(file, output, static_cast<unsigned>(min<size_t>(capacity, 1u << 30)));
+        if (read_size == 0)
+        {
+            // A cut off file ends like a complete one, only the error state tells them apart
+            int error;
+            gzerror(file, &error);
+            if (error != Z_OK)
+            {
+                return -1;
+            }
+        }
+        return read_size;
+    }
+
+private:
+    gzFile file;
+};
+#endif
+
+#if TUNER_ZSTD
+class ZstdDecoder : public StreamDecoder {
+public:
+    explicit ZstdDecoder(FILE* file) : file(file), stream(ZSTD_createDStream()), input_buffer(ZSTD_DStreamInSize())
+    {
+        ZSTD_initDStream(stream);
+    }
+
+    ~ZstdDecoder() override
+    {
+        ZSTD_freeDStream(stream);
+        fclose(file);
+    }
+
+    int64_t read(char* output, const size_t capacity) override
+    {
+        ZSTD_outBuffer output_buffer = { output, capacity, 0 };
+        while (output_buffer.pos < output_buffer.size)
+        {
+            if (input.pos == input.size)
+            {
+                const auto read_size = fread(input_buffer.data(), 1, input_buffer.size(), file);
+                if (read_size == 0)
+                {
+                    // A frame that is still open at the end of the file was cut off
+                    if (ferror(file) || frame_remaining != 0)
+                    {
+                        return -1;
+                    }
+                    break;
+                }
+                input = { input_buffer.data(), read_size, 0 };
+            }
+
+            frame_remaining = ZSTD_decompressStream(stream, &output_buffer, &input);
+            if (ZSTD_isError(frame_remaining))
+            {
+                return -1;
+            }
+        }
+        return static_cast<int64_t>(output_buffer.pos);
+    }
+
+private:
+    FILE* file;
+    ZSTD_DStream* stream;
+    vector<char> input_buffer;
+    ZSTD_inBuffer input = { nullptr, 0, 0 };
+    size_t frame_remaining = 0;
+};
+#endif
+
+StreamedFile::StreamedFile() : blocks(stream_queue_capacity)
+{
+}
+
+StreamedFile::~StreamedFile()
+{
+    close();
+}
+
+bool StreamedFile::is_streamed(const string& path)
+{
+    return is_pipe(path) || is_compressed(path);
+}
+
+bool StreamedFile::is_pipe(const string& path)
+{
+    error_code error;
+    return path == "-" || filesystem::is_fifo(path, error);
+}
+
+bool StreamedFile::is_compressed(const string& path)
+{
+    return path.ends_with(".gz") || path.ends_with(".zst");
+}
+
+bool StreamedFile::is_supported(const string& path)
+{
+    if (!is_compressed(path))
+    {
+        return true;
+    }
+#if TUNER_ZLIB
+    if (path.ends_with(".gz"))
+    {
+        return true;
+    }
+#endif
+#if TUNER_ZSTD
+    if (path.ends_with(".zst"))
+    {
+        return true;
+    }
+#endif
+    return false;
+}
+
+bool StreamedFile::open(const string& path)
+{
+    unique_ptr<StreamDecoder> decoder;
+    if (path == "-")
+    {
+        decoder = make_unique<PipeDecoder>(stdin, false);
+    }
+    else if (!is_compressed(path))
+    {
+        const auto file = fopen(path.c_str(), "rb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        decoder = make_unique<PipeDecoder>(file, true);
+    }
+#if TUNER_ZLIB
+    if (path.ends_with(".gz"))
+    {
+        const auto file = gzopen(path.c_str(), "rb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        decoder = make_unique<GzipDecoder>(file);
+    }
+#endif
+#if TUNER_ZSTD
+    if (path.ends_with(".zst"))
+    {
+        const auto file = fopen(path.c_str(), "rb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        decoder = make_unique<ZstdDecoder>(file);
+    }
+#endif
+    if (decoder == nullptr)
+    {
+        return false;
+    }
+
+    reader = thread([this, decoder = std::move(decoder)]() mutable
+    {
+        read_blocks(std::move(decoder));
+    });
+    return true;
+}
+
+// Can be called before the file is done, closing the queue stops the reader at its next block
+void StreamedFile::close()
+{
+    blocks.close();
+    if (reader.joinable())
+    {
+        reader.join();
+    }
+}
+
+bool StreamedFile::read(Block& block)
+{
+    return blocks.pop(block);
+}
+
+bool StreamedFile::failed() const
+{
+    return read_failed;
+}
+
+void StreamedFile::read_blocks(unique_ptr<StreamDecoder> decoder)
+{
+    // The partial line at the end of each block moves to the front of the next one
+    auto buffer = vector<char>(stream_block_size);
+    size_t used = 0;
+    bool done = false;
+    while (!done)
+    {
+        while (used < buffer.size())
+        {
+            const auto read_size = decoder->read(buffer.data() + used, buffer.size() - used);
+            if (read_size < 0)
+            {
+                read_failed = true;
+                blocks.close();
+                return;
+            }
+            if (read_size == 0)
+            {
+                done = true;
+                break;
+            }
+            used += static_cast<size_t>(read_size);
+        }
+
+        auto block_size = used;
+        if (!done)
+        {
+            const auto last_newline = find(make_reverse_iterator(buffer.begin() + used), buffer.rend(), '\n');
+            if (last_newline == buffer.rend())
+            {
+                buffer.resize(buffer.size() * 2);
+                continue;
+            }
+            block_size = static_cast<size_t>(buffer.rend() - last_newline);
+        }
+
+        auto next_buffer = vector<char>(max(stream_block_size, used - block_size));
+        copy(buffer.begin() + block_size, buffer.begin() + used, next_buffer.begin());
+        used -= block_size;
+        buffer.resize(block_size);
+        if (!buffer.empty() && !blocks.push(make_shared<const vector<char>>(std::move(buffer))))
+        {
+            return;
+        }
+        buffer = std::move(next_buffer);
+    }
+
+    blocks.close();
+}
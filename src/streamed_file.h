@@ -0,0 +1,50 @@
+#ifndef STREAMED_FILE_H
+#define STREAMED_FILE_H 1
+
+#include "batch_queue.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+class StreamDecoder;
+
+// Sequential reader for sources that cannot be mapped: .gz and .zst files, stdin ("-") and named pipes. Reading and
+// decompression run on their own thread, a few blocks ahead of the consumer. Every block ends at a line break (only the
+// last one may not), so lines never straddle two blocks
+class StreamedFile {
+public:
+    using Block = std::shared_ptr<const std::vector<char>>;
+
+    StreamedFile();
+    ~StreamedFile();
+    StreamedFile(const StreamedFile&) = delete;
+    StreamedFile& operator=(const StreamedFile&) = delete;
+
+    // Whether the path has to go through a StreamedFile, and whether support for its compression was compiled in
+    static bool is_streamed(const std::string& path);
+    static bool is_compressed(const std::string& path);
+    static bool is_supported(const std::string& path);
+
+    // stdin or a named pipe, which can only be read once
+    static bool is_pipe(const std::string& path);
+
+    // A StreamedFile reads a single file, it cannot be opened again after close()
+    bool open(const std::string& path);
+    void close();
+
+    // Next block of whole lines, false once the file is done or reading it failed
+    bool read(Block& block);
+    bool failed() const;
+
+private:
+    BatchQueue<Block> blocks;
+    std::thread reader;
+    std::atomic<bool> read_failed = false;
+
+    void read_blocks(std::unique_ptr<StreamDecoder> decoder);
+};
+
+#endif // !STREAMED_FILE_H
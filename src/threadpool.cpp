@@ -5,15 +5,25 @@
 
 using namespace std;
 
+// Which pool and deque the current thread works for, external threads have no deque of their own
+static thread_local const ThreadPool* current_pool = nullptr;
+static thread_local uint32_t current_worker_index = 0;
+
 void ThreadPool::start(uint32_t thread_count)
 {
     stop();
     should_stop = false;
-    for (int thread_index = 0; thread_index < thread_count; thread_index++)
+    queues.clear();
+    for (uint32_t thread_index = 0; thread_index < thread_count; thread_index++)
     {
-        threads.emplace_back([this]()
+        queues.push_back(make_unique<WorkerQueue>());
+    }
+
+    for (uint32_t thread_index = 0; thread_index < thread_count; thread_index++)
+    {
+        threads.emplace_back([this, thread_index]()
         {
-            thread_loop();
+            thread_loop(thread_index);
         });
     }
 }
@@ -23,19 +33,29 @@ uint32_t ThreadPool::thread_count() const
     return static_cast<uint32_t>(threads.size());
 }
 
+uint32_t ThreadPool::parallel_for_lanes() const
+{
+    return thread_count() + 1;
+}
+
 void ThreadPool::enqueue(const function<void()>& job)
+{
+    push(Task{ job, nullptr });
+}
+
+void ThreadPool::enqueue(TaskGroup& group, const function<void()>& job)
 {
     {
-        unique_lock<mutex> lock(queue_mutex);
-        jobs.push(job);
+        unique_lock<mutex> lock(group.group_mutex);
+        group.pending++;
     }
-    mutex_condition.notify_one();
+    push(Task{ job, &group });
 }
 
 void ThreadPool::stop()
 {
     {
-        unique_lock<mutex> lock(queue_mutex);
+        unique_lock<mutex> lock(pool_mutex);
         should_stop = true;
     }
 
@@ -50,50 +70,149 @@ void ThreadPool::stop()
 
 bool ThreadPool::is_idle()
 {
-    unique_lock<mutex> lock(queue_mutex);
-    return jobs.empty() && running_job_count == 0;
+    unique_lock<mutex> lock(pool_mutex);
+    return pending_job_count == 0;
 }
 
 void ThreadPool::wait_for_completion()
 {
-    unique_lock<mutex> lock(queue_mutex);
-    while(!jobs.empty() || running_job_count > 0)
+    unique_lock<mutex> lock(pool_mutex);
+    completion_condition.wait(lock, [this]
     {
-        completion_condition.wait(lock, [this]
-        {
-            return jobs.empty() && running_job_count == 0;
-        });
-    }
+        return pending_job_count == 0;
+    });
 }
 
-void ThreadPool::thread_loop()
+void ThreadPool::wait(TaskGroup& group)
 {
     while (true)
     {
-        function<void()> job;
         {
-            unique_lock<mutex> lock(queue_mutex);
-            mutex_condition.wait(lock, [this]
-            {
-                return !jobs.empty() || should_stop;
-            });
-
-            if (should_stop)
+            unique_lock<mutex> lock(group.group_mutex);
+            if (group.pending == 0)
             {
                 return;
             }
+        }
+
+        // Helping out keeps nested waits from starving the pool
+        Task task;
+        if (try_pop(task))
+        {
+            run(task);
+            continue;
+        }
+
+        // Everything left in the group is already running, sleep until one of its tasks finishes. The last task may
+        // have finished since the check above, so look again under the lock the snapshot is taken with
+        unique_lock<mutex> lock(group.group_mutex);
+        if (group.pending == 0)
+        {
+            return;
+        }
+        const auto pending = group.pending;
+        group.group_condition.wait(lock, [&group, pending]
+        {
+            return group.pending < pending;
+        });
+    }
+}
+
+void ThreadPool::push(Task&& task)
+{
+    // Workers push onto their own deque, everyone else spreads the tasks round robin
+    const auto queue_index = current_pool == this ? current_worker_index : next_queue.fetch_add(1) % queues.size();
+    {
+        auto& queue = *queues[queue_index];
+        unique_lock<mutex> lock(queue.queue_mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    {
+        unique_lock<mutex> lock(pool_mutex);
+        queued_job_count++;
+        pending_job_count++;
+    }
+    mutex_condition.notify_one();
+}
 
-            job = jobs.front();
-            jobs.pop();
-            running_job_count++;
+bool ThreadPool::try_pop(Task& task)
+{
+    const auto own_index = current_pool == this ? current_worker_index : 0;
+    for (size_t offset = 0; offset < queues.size(); offset++)
+    {
+        const auto queue_index = (own_index + offset) % queues.size();
+        auto& queue = *queues[queue_index];
+        unique_lock<mutex> lock(queue.queue_mutex);
+        if (queue.tasks.empty())
+        {
+            continue;
+        }
+
+        // Newest task from our own deque, oldest one when stealing
+        if (offset == 0 && current_pool == this)
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
         }
+        else
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        lock.unlock();
+
+        unique_lock<mutex> pool_lock(pool_mutex);
+        queued_job_count--;
+        return true;
+    }
+
+    return false;
+}
+
+void ThreadPool::run(Task& task)
+{
+    task.job();
 
-        job();
+    if (task.group != nullptr)
+    {
+        // Notified under the lock: once a waiter sees pending reach zero it may destroy the group, so the group
+        // must not be touched after the lock is released
+        unique_lock<mutex> lock(task.group->group_mutex);
+        task.group->pending--;
+        task.group->group_condition.notify_all();
+    }
+
+    {
+        unique_lock<mutex> lock(pool_mutex);
+        pending_job_count--;
+    }
+    completion_condition.notify_all();
+}
+
+void ThreadPool::thread_loop(uint32_t worker_index)
+{
+    current_pool = this;
+    current_worker_index = worker_index;
+
+    while (true)
+    {
+        Task task;
+        if (try_pop(task))
+        {
+            run(task);
+            continue;
+        }
+
+        unique_lock<mutex> lock(pool_mutex);
+        mutex_condition.wait(lock, [this]
+        {
+            return queued_job_count > 0 || should_stop;
+        });
 
+        if (should_stop)
         {
-            unique_lock<mutex> lock(queue_mutex);
-            running_job_count--;
-            completion_condition.notify_all();
+            return;
         }
     }
 }
@@ -1,31 +1,115 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H 1
 
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <cstddef>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
 
+// A set of tasks that can be waited on independently of everything else running in the pool
+class TaskGroup {
+public:
+    TaskGroup() = default;
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+private:
+    friend class ThreadPool;
+    uint32_t pending = 0;
+    std::mutex group_mutex;
+    std::condition_variable group_condition;
+};
+
+// Work-stealing pool: every worker has its own deque, pops its newest task and steals the oldest tasks of the others
 class ThreadPool {
 public:
     void start(uint32_t thread_count);
     uint32_t thread_count() const;
     void enqueue(const std::function<void()>& job);
+    void enqueue(TaskGroup& group, const std::function<void()>& job);
     void stop();
     bool is_idle();
     void wait_for_completion();
 
+    // Waits for every task of the group, running queued tasks in the meantime
+    void wait(TaskGroup& group);
+
+    // Number of distinct lane ids parallel_for hands to its body
+    uint32_t parallel_for_lanes() const;
+
+    // Calls body(chunk_begin, chunk_end, lane) over [begin, end) in chunks of at most grain items. Chunks are claimed
+    // dynamically, so uneven chunks balance out. Lanes running concurrently never share a lane id, which makes the
+    // lane id usable as an index into per-lane accumulators. The calling thread works on chunks too
+    template<typename F>
+    void parallel_for(size_t begin, size_t end, size_t grain, F&& body)
+    {
+        if (begin >= end)
+        {
+            return;
+        }
+
+        grain = std::max<size_t>(grain, 1);
+        std::atomic<size_t> next_chunk = begin;
+        auto run_lane = [&next_chunk, end, grain, &body](const uint32_t lane)
+        {
+            while (true)
+            {
+                const auto chunk_begin = next_chunk.fetch_add(grain);
+                if (chunk_begin >= end)
+                {
+                    break;
+                }
+                body(chunk_begin, std::min(chunk_begin + grain, end), lane);
+            }
+        };
+
+        const auto chunk_count = (end - begin + grain - 1) / grain;
+        const auto helper_count = static_cast<uint32_t>(std::min<size_t>(thread_count(), chunk_count - 1));
+        TaskGroup group;
+        for (uint32_t lane = 0; lane < helper_count; lane++)
+        {
+            enqueue(group, [&run_lane, lane]()
+            {
+                run_lane(lane);
+            });
+        }
+        run_lane(thread_count());
+        wait(group);
+    }
+
 private:
+    struct Task
+    {
+        std::function<void()> job;
+        TaskGroup* group;
+    };
+
+    struct WorkerQueue
+    {
+        std::mutex queue_mutex;
+        std::deque<Task> tasks;
+    };
+
     bool should_stop = false;
-    uint32_t running_job_count = 0;
-    std::mutex queue_mutex;
+    uint32_t queued_job_count = 0;
+    uint32_t pending_job_count = 0;
+    std::atomic<uint32_t> next_queue = 0;
+    std::mutex pool_mutex;
     std::condition_variable mutex_condition;
     std::condition_variable completion_condition;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
     std::vector<std::thread> threads;
-    std::queue<std::function<void()>> jobs;
 
-    void thread_loop();
+    void push(Task&& task);
+    bool try_pop(Task& task);
+    void run(Task& task);
+    void thread_loop(uint32_t worker_index);
 };
 
 #endif // !THREADPOOL_H
@@ -1,16 +1,37 @@
 #include "tuner.h"
+#include "batch_queue.h"
 #include "config.h"
+#include "epoch_workers.h"
+#include "line_index.h"
+#include "mapped_file.h"
+#include "packed_board.h"
+#include "streamed_file.h"
 #include "threadpool.h"
 #include "external/chess.hpp"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <concepts>
 #include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <span>
 #include <sstream>
 #include <stdexcept>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <cstdlib> 
 
@@ -22,21 +43,57 @@ using namespace Tuner;
 static_assert(false, "Tuner requires TAPERED to be defined")
 #endif
 
+// The SIMD kernels are picked at compile time, see TUNER_NATIVE in CMakeLists.txt
+#if defined(__AVX512F__) && defined(__AVX512CD__)
+#define TUNER_SIMD 512
+#elif defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+#define TUNER_SIMD 256
+#else
+#define TUNER_SIMD 0
+#endif
+
+#if TUNER_SIMD
+#include <immintrin.h>
+#endif
+
 struct WdlMarker
 {
     string marker;
     tune_t wdl;
 };
 
+// A parameter index in the upper 24 bits and a signed 8 bit count in the lower 8 bits. Larger counts are split into
+// several entries with the same index, which is rare enough to cost next to nothing
 struct CoefficientEntry
 {
-    int16_t value;
-    int16_t index;
+    uint32_t packed;
+
+    static constexpr int32_t value_bits = 8;
+    static constexpr int32_t max_value = 127;
+    static constexpr uint32_t max_parameter_count = 1u << (32 - value_bits);
+
+    CoefficientEntry() = default;
+
+    CoefficientEntry(const int32_t value, const uint32_t index)
+        : packed((index << value_bits) | static_cast<uint8_t>(static_cast<int8_t>(value)))
+    {
+    }
+
+    int32_t value() const
+    {
+        return static_cast<int8_t>(packed & 0xFF);
+    }
+
+    uint32_t index() const
+    {
+        return packed >> value_bits;
+    }
 };
 
+// A single position, the coefficients point either into a Dataset or into a scratch buffer while parsing
 struct Entry
 {
-    vector<CoefficientEntry> coefficients;
+    span<const CoefficientEntry> coefficients;
     tune_t wdl;
     bool white_to_move;
     //tune_t initial_eval;
@@ -45,6 +102,206 @@ struct Entry
     int32_t phase;
     tune_t endgame_scale;
 #endif
+    // How many identical positions this entry stands for, see merge_duplicate_rows
+    tune_t weight = 1;
+};
+
+// With compress_coefficients, each coefficient of an entry is stored as a varint of (index delta << 4) | value nibble,
+// where the nibble holds values -7 to 7 and 15 escapes to a raw int8 value in the next byte. Indices within an entry are
+// ascending, so most coefficients take one or two bytes instead of four
+using coefficient_storage_t = conditional_t<compress_coefficients, uint8_t, CoefficientEntry>;
+
+static constexpr uint32_t coefficient_value_escape = 15;
+
+static void encode_coefficients(const span<const CoefficientEntry> coefficients, vector<uint8_t>& bytes)
+{
+    uint32_t previous_index = 0;
+    for (const auto& coefficient : coefficients)
+    {
+        const auto index = coefficient.index();
+        if (index < previous_index)
+        {
+            throw runtime_error("Coefficient indices have to be ascending to be compressed");
+        }
+
+        const auto value = coefficient.value();
+        const uint32_t nibble = value >= -7 && value <= 7 ? static_cast<uint32_t>(value + 7) : coefficient_value_escape;
+        auto token = ((index - previous_index) << 4) | nibble;
+        while (token >= 0x80)
+        {
+            bytes.push_back(static_cast<uint8_t>(token | 0x80));
+            token >>= 7;
+        }
+        bytes.push_back(static_cast<uint8_t>(token));
+        if (nibble == coefficient_value_escape)
+        {
+            bytes.push_back(static_cast<uint8_t>(static_cast<int8_t>(value)));
+        }
+        previous_index = index;
+    }
+}
+
+// Decodes into coefficients, which needs room for one entry per encoded byte, and returns the number of entries
+static size_t decode_coefficients(const uint8_t* cursor, const uint8_t* const end, CoefficientEntry* coefficients)
+{
+    size_t count = 0;
+    uint32_t index = 0;
+    while (cursor < end)
+    {
+        uint32_t token = *cursor++;
+        if (token & 0x80)
+        {
+            token &= 0x7F;
+            int32_t shift = 7;
+            uint8_t byte;
+            do
+            {
+                byte = *cursor++;
+                token |= static_cast<uint32_t>(byte & 0x7F) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+        }
+
+        index += token >> 4;
+        const auto nibble = token & 0xF;
+        const auto value = nibble == coefficient_value_escape ? static_cast<int32_t>(static_cast<int8_t>(*cursor++)) : static_cast<int32_t>(nibble) - 7;
+        coefficients[count++] = CoefficientEntry(value, index);
+    }
+    return count;
+}
+
+static span<const CoefficientEntry> view_coefficients(const CoefficientEntry* begin, const CoefficientEntry* end)
+{
+    return span<const CoefficientEntry>(begin, end);
+}
+
+static span<const CoefficientEntry> view_coefficients(const uint8_t* begin, const uint8_t* end)
+{
+    thread_local vector<CoefficientEntry> decoded;
+    if (decoded.size() < static_cast<size_t>(end - begin))
+    {
+        decoded.resize(end - begin);
+    }
+    const auto count = decode_coefficients(begin, end, decoded.data());
+    return span<const CoefficientEntry>(decoded.data(), count);
+}
+
+static void store_coefficients(const span<const CoefficientEntry> coefficients, vector<CoefficientEntry>& storage)
+{
+    storage.insert(storage.end(), coefficients.begin(), coefficients.end());
+}
+
+static void store_coefficients(const span<const CoefficientEntry> coefficients, vector<uint8_t>& storage)
+{
+    encode_coefficients(coefficients, storage);
+}
+
+// Everything about a position except its coefficients, packed into 16 bytes. The wdl is a float so the mean wdl of merged
+// entries stays exact enough to leave the optimum where it was
+struct EntryHeader
+{
+    float additional_score;
+    float endgame_scale;
+    float wdl;
+    uint16_t weight;
+    uint8_t phase;
+    uint8_t flags;
+};
+
+static_assert(sizeof(EntryHeader) == 16, "EntryHeader should stay packed");
+
+static constexpr uint8_t entry_white_to_move_flag = 1;
+static constexpr uint32_t max_entry_weight = numeric_limits<uint16_t>::max();
+
+static tune_t get_header_wdl(const EntryHeader& header)
+{
+    return header.wdl;
+}
+
+// Positions by side to move (black, white) and by result (1.0, 0.5, 0.0, anything else). Counted as positions are added,
+// merged and deduplicated entries only keep the mean wdl of their copies
+using result_counts_t = array<array<uint64_t, 4>, 2>;
+
+// All positions stored struct-of-arrays: the coefficients of every entry live in one flat array,
+// entry i owns coefficients[offsets[i]] up to coefficients[offsets[i + 1]], and everything else lives in headers[i].
+// Errors and gradients are averaged over weight_sum, the number of positions the entries stand for, and error_offset
+// is the part of the summed squared error that merging duplicates took out of the entries
+struct Dataset
+{
+    vector<coefficient_storage_t> coefficients;
+    vector<uint64_t> offsets = { 0 };
+    vector<EntryHeader> headers;
+    uint64_t weight_sum = 0;
+    double error_offset = 0;
+    result_counts_t result_counts{};
+
+    size_t size() const
+    {
+        return headers.size();
+    }
+
+    // Compressed coefficients are decoded into a per-thread buffer, which stays valid until the next entry is read on the thread
+    Entry operator[](const size_t index) const
+    {
+        const auto& header = headers[index];
+        Entry entry;
+        entry.coefficients = view_coefficients(coefficients.data() + offsets[index], coefficients.data() + offsets[index + 1]);
+        entry.wdl = get_header_wdl(header);
+        entry.white_to_move = (header.flags & entry_white_to_move_flag) != 0;
+        entry.additional_score = header.additional_score;
+#if TAPERED
+        entry.phase = header.phase;
+        entry.endgame_scale = header.endgame_scale;
+#endif
+        entry.weight = static_cast<tune_t>(header.weight);
+        return entry;
+    }
+
+    void push_back(const Entry& entry)
+    {
+        store_coefficients(entry.coefficients, coefficients);
+        offsets.push_back(coefficients.size());
+
+        EntryHeader header{};
+        header.additional_score = static_cast<float>(entry.additional_score);
+        header.wdl = static_cast<float>(entry.wdl);
+        header.flags = entry.white_to_move ? entry_white_to_move_flag : 0;
+#if TAPERED
+        header.endgame_scale = static_cast<float>(entry.endgame_scale);
+        header.phase = static_cast<uint8_t>(entry.phase);
+#else
+        header.endgame_scale = 1;
+#endif
+        header.weight = static_cast<uint16_t>(entry.weight);
+        headers.push_back(header);
+        weight_sum += header.weight;
+    }
+
+    void append(const Dataset& other)
+    {
+        const auto offset_base = coefficients.size();
+        coefficients.insert(coefficients.end(), other.coefficients.begin(), other.coefficients.end());
+        for (size_t index = 1; index < other.offsets.size(); index++)
+        {
+            offsets.push_back(offset_base + other.offsets[index]);
+        }
+        headers.insert(headers.end(), other.headers.begin(), other.headers.end());
+        weight_sum += other.weight_sum;
+        error_offset += other.error_offset;
+        for (size_t side = 0; side < result_counts.size(); side++)
+        {
+            for (size_t result = 0; result < result_counts[side].size(); result++)
+            {
+                result_counts[side][result] += other.result_counts[side][result];
+            }
+        }
+    }
+
+    void count_result(const bool white_to_move, const tune_t wdl)
+    {
+        const auto result = wdl == 1 ? 0 : wdl == static_cast<tune_t>(0.5) ? 1 : wdl == 0 ? 2 : 3;
+        result_counts[white_to_move][result]++;
+    }
 };
 
 static const array<WdlMarker, 4> markers
@@ -56,13 +313,13 @@ static const array<WdlMarker, 4> markers
     WdlMarker{"0-1", 0}
 };
 
-static tune_t get_fen_wdl(const string& original_fen, const bool original_white_to_move, const bool white_to_move, const bool side_to_move_wdl)
+static tune_t get_fen_wdl(const string_view original_fen, const bool original_white_to_move, const bool white_to_move, const bool side_to_move_wdl)
 {
     tune_t wdl;
     bool marker_found = false;
     for (auto& marker : markers)
     {
-        if (original_fen.find(marker.marker) != std::string::npos)
+        if (original_fen.find(marker.marker) != string_view::npos)
         {
             if (marker_found)
             {
@@ -76,7 +333,7 @@ static tune_t get_fen_wdl(const string& original_fen, const bool original_white_
 
     if(!marker_found)
     {
-        stringstream ss(original_fen);
+        stringstream ss{string(original_fen)};
         while (!ss.eof())
         {
             string word;
@@ -108,9 +365,9 @@ static tune_t get_fen_wdl(const string& original_fen, const bool original_white_
     return wdl;
 }   
 
-static bool get_fen_color_to_move(const string& fen)
+static bool get_fen_color_to_move(const string_view fen)
 {
-    return fen.find('w') != std::string::npos;
+    return fen.find('w') != string_view::npos;
 }
 
 static void print_elapsed(high_resolution_clock::time_point start)
@@ -121,6 +378,29 @@ static void print_elapsed(high_resolution_clock::time_point start)
     cout << "[" << elapsed_seconds << "s] ";
 }
 
+static void check_parameter_count(const size_t parameter_count)
+{
+    if (parameter_count > CoefficientEntry::max_parameter_count)
+    {
+        throw runtime_error("Too many parameters, coefficient indices are limited to " + to_string(CoefficientEntry::max_parameter_count));
+    }
+}
+
+static void add_coefficient_entry(vector<CoefficientEntry>& coefficient_entries, int32_t value, const uint32_t index)
+{
+    while (value > CoefficientEntry::max_value)
+    {
+        coefficient_entries.emplace_back(CoefficientEntry::max_value, index);
+        value -= CoefficientEntry::max_value;
+    }
+    while (value < -CoefficientEntry::max_value)
+    {
+        coefficient_entries.emplace_back(-CoefficientEntry::max_value, index);
+        value += CoefficientEntry::max_value;
+    }
+    coefficient_entries.emplace_back(value, index);
+}
+
 static void get_coefficient_entries(const coefficients_t& coefficients, vector<CoefficientEntry>& coefficient_entries, int32_t parameter_count)
 {
     if(coefficients.size() != parameter_count)
@@ -128,41 +408,303 @@ static void get_coefficient_entries(const coefficients_t& coefficients, vector<C
         throw runtime_error("Parameter count mismatch");
     }
 
-    for (int16_t i = 0; i < coefficients.size(); i++)
+    for (uint32_t i = 0; i < coefficients.size(); i++)
     {
         if (coefficients[i] == 0)
         {
             continue;
         }
 
-        const auto coefficient_entry = CoefficientEntry{coefficients[i], i};
-        coefficient_entries.push_back(coefficient_entry);
+        add_coefficient_entry(coefficient_entries, coefficients[i], i);
     }
 }
 
-static tune_t linear_eval(const Entry& entry, const parameters_t& parameters)
+template<typename T>
+concept SparseTraceEval = requires(const chess::Board& board, TraceSink& sink)
 {
-    tune_t score = entry.additional_score;
-#if TAPERED 
-    tune_t midgame = 0;
-    tune_t endgame = 0;
-    for (const auto& coefficient : entry.coefficients)
+    { T::get_external_sparse_eval_result(board, sink) } -> same_as<EvalResult>;
+};
+
+// Evaluates the board and appends its non-zero coefficients. Engines with a sparse trace report their terms straight
+// into a per-thread sink, everything else goes through the dense coefficients_t
+template<typename Eval>
+static EvalResult get_eval_result(const chess::Board& board, vector<CoefficientEntry>& coefficient_entries, const int32_t parameter_count)
+{
+    if constexpr (SparseTraceEval<Eval>)
+    {
+        thread_local TraceSink sink;
+        if (sink.size() != parameter_count)
+        {
+            sink.resize(parameter_count);
+        }
+
+        const auto eval_result = Eval::get_external_sparse_eval_result(board, sink);
+        sink.drain([&coefficient_entries](const int32_t parameter_index, const int32_t value)
+        {
+            add_coefficient_entry(coefficient_entries, value, static_cast<uint32_t>(parameter_index));
+        });
+        return eval_result;
+    }
+    else
+    {
+        EvalResult eval_result;
+        if constexpr (Eval::supports_external_chess_eval)
+        {
+            eval_result = Eval::get_external_eval_result(board);
+        }
+        else
+        {
+            auto fen = board.getFen();
+            eval_result = Eval::get_fen_eval_result(fen);
+        }
+
+        get_coefficient_entries(eval_result.coefficients, coefficient_entries, parameter_count);
+        return eval_result;
+    }
+}
+
+#if TUNER_SIMD
+static_assert(sizeof(CoefficientEntry) == 4 && CoefficientEntry::value_bits == 8, "SIMD kernels expect a 24 bit index above an 8 bit value");
+
+// Splits four consecutive coefficients into 32 bit indices and sign extended values
+[[maybe_unused]] static __m128i unpack_coefficients(const CoefficientEntry* coefficients, __m128i& values)
+{
+    const auto packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(coefficients));
+    values = _mm_srai_epi32(_mm_slli_epi32(packed, 24), 24);
+    return _mm_srli_epi32(packed, 8);
+}
+#endif
+
+#if TAPERED
+struct TaperedSum
+{
+    tune_t midgame;
+    tune_t endgame;
+};
+
+// Sum of coefficient * parameter, separately for the midgame and endgame halves
+static TaperedSum sum_coefficients(const span<const CoefficientEntry> coefficients, const parameters_t& parameters)
+{
+#if TUNER_SIMD && TUNER_SINGLE_PRECISION
+    // A float pair is 64 bits, so four pairs come in with a single gather of doubles.
+    // Midgame accumulates in the even lanes, endgame in the odd ones
+    const auto pair_lanes = reinterpret_cast<const double*>(parameters.data());
+    const auto count = coefficients.size();
+    size_t i = 0;
+    __m256 wide_sums = _mm256_setzero_ps();
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i values;
+        const auto indices = unpack_coefficients(&coefficients[i], values);
+        const auto pair_values = _mm256_cvtepi32_ps(_mm256_set_m128i(_mm_unpackhi_epi32(values, values), _mm_unpacklo_epi32(values, values)));
+        const auto pairs = _mm256_castpd_ps(_mm256_i32gather_pd(pair_lanes, indices, sizeof(pair_t)));
+        wide_sums = _mm256_fmadd_ps(pair_values, pairs, wide_sums);
+    }
+    auto sums = _mm_add_ps(_mm256_castps256_ps128(wide_sums), _mm256_extractf128_ps(wide_sums, 1));
+    sums = _mm_add_ps(sums, _mm_movehl_ps(sums, sums));
+    TaperedSum result{ _mm_cvtss_f32(sums), _mm_cvtss_f32(_mm_shuffle_ps(sums, sums, 1)) };
+    for (; i < count; i++)
+    {
+        const auto& coefficient = coefficients[i];
+        result.midgame += coefficient.value() * parameters[coefficient.index()][static_cast<int32_t>(PhaseStages::Midgame)];
+        result.endgame += coefficient.value() * parameters[coefficient.index()][static_cast<int32_t>(PhaseStages::Endgame)];
+    }
+    return result;
+#elif TUNER_SIMD
+    const auto parameter_lanes = reinterpret_cast<const tune_t*>(parameters.data());
+    const auto count = coefficients.size();
+    size_t i = 0;
+    // Midgame accumulates in the even lanes, endgame in the odd ones. Parameter pairs are two adjacent doubles,
+    // so they are loaded 128 bits at a time; 512 bit gathers measured slower than this on tapered evals
+    __m256d low_sums = _mm256_setzero_pd();
+    __m256d high_sums = _mm256_setzero_pd();
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i values;
+        unpack_coefficients(&coefficients[i], values);
+        const auto low_values = _mm256_cvtepi32_pd(_mm_unpacklo_epi32(values, values));
+        const auto high_values = _mm256_cvtepi32_pd(_mm_unpackhi_epi32(values, values));
+        const auto low_pairs = _mm256_set_m128d(_mm_loadu_pd(parameters[coefficients[i + 1].index()].data()), _mm_loadu_pd(parameters[coefficients[i].index()].data()));
+        const auto high_pairs = _mm256_set_m128d(_mm_loadu_pd(parameters[coefficients[i + 3].index()].data()), _mm_loadu_pd(parameters[coefficients[i + 2].index()].data()));
+        low_sums = _mm256_fmadd_pd(low_values, low_pairs, low_sums);
+        high_sums = _mm256_fmadd_pd(high_values, high_pairs, high_sums);
+    }
+    const auto total_sums = _mm256_add_pd(low_sums, high_sums);
+    auto sums = _mm_add_pd(_mm256_castpd256_pd128(total_sums), _mm256_extractf128_pd(total_sums, 1));
+    for (; i < count; i++)
+    {
+        const auto& coefficient = coefficients[i];
+        sums = _mm_fmadd_pd(_mm_set1_pd(coefficient.value()), _mm_loadu_pd(parameter_lanes + 2 * coefficient.index()), sums);
+    }
+    return TaperedSum{ _mm_cvtsd_f64(sums), _mm_cvtsd_f64(_mm_unpackhi_pd(sums, sums)) };
+#else
+    TaperedSum sums{};
+    for (const auto& coefficient : coefficients)
+    {
+        sums.midgame += coefficient.value() * parameters[coefficient.index()][static_cast<int32_t>(PhaseStages::Midgame)];
+        sums.endgame += coefficient.value() * parameters[coefficient.index()][static_cast<int32_t>(PhaseStages::Endgame)];
+    }
+    return sums;
+#endif
+}
+
+// gradient[index] += coefficient * base, separately for the midgame and endgame halves
+static void add_coefficients(const span<const CoefficientEntry> coefficients, const tune_t midgame_base, const tune_t endgame_base, parameters_t& gradient)
+{
+#if TUNER_SIMD && !TUNER_SINGLE_PRECISION
+    // Each pair is updated with a single 128 bit fused multiply-add
+    const auto gradient_lanes = reinterpret_cast<tune_t*>(gradient.data());
+    const auto bases = _mm_set_pd(endgame_base, midgame_base);
+    for (const auto& coefficient : coefficients)
+    {
+        const auto lane = gradient_lanes + 2 * coefficient.index();
+        _mm_storeu_pd(lane, _mm_fmadd_pd(_mm_set1_pd(coefficient.value()), bases, _mm_loadu_pd(lane)));
+    }
+#else
+    // A float pair is only 64 bits wide, scalar updates are as fast as a vector one there
+    for (const auto& coefficient : coefficients)
+    {
+        gradient[coefficient.index()][static_cast<int32_t>(PhaseStages::Midgame)] += midgame_base * coefficient.value();
+        gradient[coefficient.index()][static_cast<int32_t>(PhaseStages::Endgame)] += endgame_base * coefficient.value();
+    }
+#endif
+}
+#else
+#if TUNER_SIMD && !TUNER_SINGLE_PRECISION
+static tune_t horizontal_sum(const __m256d sums)
+{
+    const auto halves = _mm_add_pd(_mm256_castpd256_pd128(sums), _mm256_extractf128_pd(sums, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(halves, _mm_unpackhi_pd(halves, halves)));
+}
+#endif
+
+static tune_t sum_coefficients(const span<const CoefficientEntry> coefficients, const parameters_t& parameters)
+{
+#if TUNER_SIMD && TUNER_SINGLE_PRECISION
+    const auto count = coefficients.size();
+    size_t i = 0;
+    __m256 wide_sums = _mm256_setzero_ps();
+    for (; i + 8 <= count; i += 8)
+    {
+        const auto packed = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&coefficients[i]));
+        const auto values = _mm256_srai_epi32(_mm256_slli_epi32(packed, 24), 24);
+        const auto indices = _mm256_srli_epi32(packed, 8);
+        wide_sums = _mm256_fmadd_ps(_mm256_cvtepi32_ps(values), _mm256_i32gather_ps(parameters.data(), indices, sizeof(tune_t)), wide_sums);
+    }
+    auto sums = _mm_add_ps(_mm256_castps256_ps128(wide_sums), _mm256_extractf128_ps(wide_sums, 1));
+    sums = _mm_add_ps(sums, _mm_movehl_ps(sums, sums));
+    tune_t sum = _mm_cvtss_f32(_mm_add_ss(sums, _mm_shuffle_ps(sums, sums, 1)));
+    for (; i < count; i++)
+    {
+        sum += coefficients[i].value() * parameters[coefficients[i].index()];
+    }
+    return sum;
+#elif TUNER_SIMD
+    const auto count = coefficients.size();
+    size_t i = 0;
+    __m256d wide_sums = _mm256_setzero_pd();
+#if TUNER_SIMD == 512
+    __m512d widest_sums = _mm512_setzero_pd();
+    for (; i + 8 <= count; i += 8)
+    {
+        const auto packed = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&coefficients[i]));
+        const auto values = _mm256_srai_epi32(_mm256_slli_epi32(packed, 24), 24);
+        const auto indices = _mm256_srli_epi32(packed, 8);
+        widest_sums = _mm512_fmadd_pd(_mm512_cvtepi32_pd(values), _mm512_i32gather_pd(indices, parameters.data(), sizeof(tune_t)), widest_sums);
+    }
+    wide_sums = _mm256_add_pd(_mm512_castpd512_pd256(widest_sums), _mm512_extractf64x4_pd(widest_sums, 1));
+#endif
+    for (; i + 4 <= count; i += 4)
     {
-        midgame += coefficient.value * parameters[coefficient.index][static_cast<int32_t>(PhaseStages::Midgame)];
-        endgame += coefficient.value * parameters[coefficient.index][static_cast<int32_t>(PhaseStages::Endgame)] * entry.endgame_scale;
+        __m128i values;
+        const auto indices = unpack_coefficients(&coefficients[i], values);
+        wide_sums = _mm256_fmadd_pd(_mm256_cvtepi32_pd(values), _mm256_i32gather_pd(parameters.data(), indices, sizeof(tune_t)), wide_sums);
     }
-    score += (midgame * entry.phase + endgame * (24 - entry.phase)) / 24;
+    tune_t sum = horizontal_sum(wide_sums);
+    for (; i < count; i++)
+    {
+        sum += coefficients[i].value() * parameters[coefficients[i].index()];
+    }
+    return sum;
 #else
-    for (const auto& coefficient : entry.coefficients)
+    tune_t sum = 0;
+    for (const auto& coefficient : coefficients)
+    {
+        sum += coefficient.value() * parameters[coefficient.index()];
+    }
+    return sum;
+#endif
+}
+
+static void add_coefficients(const span<const CoefficientEntry> coefficients, const tune_t base, parameters_t& gradient)
+{
+    size_t i = 0;
+#if TUNER_SIMD == 512 && !TUNER_SINGLE_PRECISION
+    const auto count = coefficients.size();
+    const auto wide_base = _mm512_set1_pd(base);
+    for (; i + 8 <= count; i += 8)
+    {
+        const auto packed = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&coefficients[i]));
+        const auto values = _mm256_srai_epi32(_mm256_slli_epi32(packed, 24), 24);
+        const auto indices = _mm256_srli_epi32(packed, 8);
+
+        // Large counts split into entries sharing an index, a scatter would drop all but one of those lanes
+        const auto conflicts = _mm512_maskz_conflict_epi32(0xFF, _mm512_zextsi256_si512(indices));
+        if (_mm512_test_epi32_mask(conflicts, conflicts) != 0)
+        {
+            for (size_t j = i; j < i + 8; j++)
+            {
+                gradient[coefficients[j].index()] += base * coefficients[j].value();
+            }
+            continue;
+        }
+
+        const auto updated = _mm512_fmadd_pd(_mm512_cvtepi32_pd(values), wide_base, _mm512_i32gather_pd(indices, gradient.data(), sizeof(tune_t)));
+        _mm512_i32scatter_pd(gradient.data(), indices, updated, sizeof(tune_t));
+    }
+#endif
+    for (; i < coefficients.size(); i++)
+    {
+        gradient[coefficients[i].index()] += base * coefficients[i].value();
+    }
+}
+#endif
+
+#if TAPERED
+struct PhaseWeights
+{
+    tune_t midgame;
+    tune_t endgame;
+};
+
+// Midgame and endgame weight of every phase, so the hot loops never divide by 24
+static constexpr auto phase_weights = []()
+{
+    array<PhaseWeights, 25> weights{};
+    for (int32_t phase = 0; phase <= 24; phase++)
     {
-        score += coefficient.value * parameters[coefficient.index];
+        weights[phase] = PhaseWeights{ phase / static_cast<tune_t>(24), (24 - phase) / static_cast<tune_t>(24) };
     }
+    return weights;
+}();
+#endif
+
+static tune_t linear_eval(const Entry& entry, const parameters_t& parameters)
+{
+    tune_t score = entry.additional_score;
+#if TAPERED 
+    const auto sums = sum_coefficients(entry.coefficients, parameters);
+    const auto& weights = phase_weights[entry.phase];
+    score += sums.midgame * weights.midgame + sums.endgame * entry.endgame_scale * weights.endgame;
+#else
+    score += sum_coefficients(entry.coefficients, parameters);
 #endif
 
     return score;
 }
 
-static int32_t get_phase(const string& fen)
+// Game phase counted from the piece placement of the fen, without parsing the whole board
+static int32_t get_phase(const string_view fen)
 {
     int32_t phase = 0;
     auto stop = false;
@@ -207,7 +749,8 @@ static int32_t get_phase(const string& fen)
             break;
         }
     }
-    return phase;
+    // Promotions can push the phase past the starting material
+    return min(phase, 24);
 }
 
 static int32_t get_phase(const chess::Board& board)
@@ -237,37 +780,23 @@ static int32_t get_phase(const chess::Board& board)
         }
     }
 
-    return phase;
+    // Promotions can push the phase past the starting material
+    return min(phase, 24);
 }
 
-static void print_statistics(const parameters_t& parameters, const vector<Entry>& entries)
+static void print_statistics(const parameters_t& parameters, const Dataset& entries)
 {
-    array<size_t, 2> wins{};
-    array<size_t, 2> draws{};
-    array<size_t, 2> losses{};
-    array<size_t, 2> total{};
     array<tune_t, 2> wdls{};
 
     size_t min_parameters = std::numeric_limits<uint64_t>::max();
     size_t max_parameters = 0;
     size_t total_parameters = 0;
 
-    for(auto& entry : entries)
+    for(size_t entry_index = 0; entry_index < entries.size(); entry_index++)
     {
-        if(entry.wdl == 1)
-        {
-            wins[entry.white_to_move]++;
-        }
-        else if(entry.wdl == 0.5)
-        {
-            draws[entry.white_to_move]++;
-        }
-        else if (entry.wdl == 0.0)
-        {
-            losses[entry.white_to_move]++;
-        }
-        total[entry.white_to_move]++;
-        wdls[entry.white_to_move] += entry.wdl;
+        // Merged entries hold the mean wdl of the positions they stand for
+        const auto entry = entries[entry_index];
+        wdls[entry.white_to_move] += entry.wdl * entry.weight;
 
         if(entry.coefficients.size() < min_parameters)
         {
@@ -283,15 +812,19 @@ static void print_statistics(const parameters_t& parameters, const vector<Entry>
     }
 
     cout << "Dataset statistics:" << endl;
-    cout << "Total positions: " << entries.size() << endl;
+    cout << "Total positions: " << entries.weight_sum << endl;
+    cout << "Unique entries: " << entries.size() << endl;
     for(int color = 1; color >= 0; color--)
     {
+        const auto& counts = entries.result_counts[color];
+        const auto total = counts[0] + counts[1] + counts[2] + counts[3];
         const auto color_name = color ? "White" : "Black";
-        cout << color_name << ": " << total[color] << " (" << (total[color] * 100.0 / entries.size()) << "%)" << endl;
-        cout << color_name << " 1.0: " << wins[color] << " (" << (wins[color] * 100.0 / entries.size()) << "%)" << endl;
-        cout << color_name << " 0.5: " << draws[color] << " (" << (draws[color] * 100.0 / entries.size()) << "%)" << endl;
-        cout << color_name << " 0.0: " << losses[color] << " (" << (losses[color] * 100.0 / entries.size()) << "%)" << endl;
-        cout << color_name << " avg: " << wdls[color] / total[color] << endl;
+        cout << color_name << ": " << total << " (" << (total * 100.0 / entries.weight_sum) << "%)" << endl;
+        cout << color_name << " 1.0: " << counts[0] << " (" << (counts[0] * 100.0 / entries.weight_sum) << "%)" << endl;
+        cout << color_name << " 0.5: " << counts[1] << " (" << (counts[1] * 100.0 / entries.weight_sum) << "%)" << endl;
+        cout << color_name << " 0.0: " << counts[2] << " (" << (counts[2] * 100.0 / entries.weight_sum) << "%)" << endl;
+        cout << color_name << " other: " << counts[3] << " (" << (counts[3] * 100.0 / entries.weight_sum) << "%)" << endl;
+        cout << color_name << " avg: " << wdls[color] / total << endl;
     }
 
     auto avg_parameters = static_cast<tune_t>(total_parameters) / entries.size();
@@ -299,6 +832,7 @@ static void print_statistics(const parameters_t& parameters, const vector<Entry>
     cout << "Parameters min: " << min_parameters << endl;
     cout << "Parameters max: " << max_parameters << endl;
     cout << "Parameters avg: " << avg_parameters << endl;
+    cout << "Coefficient memory: " << entries.coefficients.size() * sizeof(coefficient_storage_t) / (1024.0 * 1024.0) << " MB" << (compress_coefficients ? " (compressed)" : "") << endl;
 
     cout << endl;
 }
@@ -364,23 +898,16 @@ static tune_t quiescence(chess::Board& board, const parameters_t& parameters, pv
 {
     pv_table[ply].length = 0;
 
-    EvalResult eval_result;
-    if constexpr (TuneEval::supports_external_chess_eval)
-    {
-        eval_result = TuneEval::get_external_eval_result(board);
-    }
-    else
-    {
-        auto fen = board.getFen();
-        eval_result = TuneEval::get_fen_eval_result(fen);
-    }
+    thread_local vector<CoefficientEntry> coefficients;
+    coefficients.clear();
+    const auto eval_result = get_eval_result<TuneEval>(board, coefficients, static_cast<int32_t>(parameters.size()));
 
     Entry entry;
+    entry.coefficients = coefficients;
     entry.white_to_move = board.sideToMove() == chess::Color::WHITE;
 #if TAPERED
     entry.endgame_scale = eval_result.endgame_scale;
 #endif
-    get_coefficient_entries(eval_result.coefficients, entry.coefficients, static_cast<int32_t>(parameters.size()));
 #if TAPERED
     entry.phase = get_phase(board);
 #endif
@@ -467,7 +994,7 @@ static tune_t quiescence(chess::Board& board, const parameters_t& parameters, pv
     return best_score;
 }
 
-string cleanup_fen(const string& initial_fen)
+string_view cleanup_fen(const string_view initial_fen)
 {
     int space_count = 0;
     size_t pos = 0;
@@ -513,305 +1040,1902 @@ chess::Board quiescence_root(const parameters_t& parameters, chess::Board board)
     return board;
 }
 
-static void parse_fen(const bool side_to_move_wdl, const parameters_t& parameters, vector<Entry>& entries, const string& original_fen)
+static constexpr uint64_t hash_seed = 0x9E3779B97F4A7C15ull;
+
+static uint64_t hash_bytes(const void* data, const size_t size, uint64_t hash)
 {
-    if constexpr (print_data_entries)
+    constexpr uint64_t multiplier = 0xFF51AFD7ED558CCDull;
+    const auto bytes = static_cast<const uint8_t*>(data);
+    size_t offset = 0;
+    for (; offset + sizeof(uint64_t) <= size; offset += sizeof(uint64_t))
     {
-        cout << original_fen;
+        uint64_t word;
+        memcpy(&word, bytes + offset, sizeof(word));
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 32;
     }
-
-    //string fen;
-    const auto clean_fen = cleanup_fen(original_fen);
-    chess::Board board = chess::Board(clean_fen);
-
-    if constexpr (TuneEval::filter_in_check)
+    for (; offset < size; offset++)
     {
-        if (board.inCheck())
-            return;
+        hash = (hash ^ bytes[offset]) * multiplier;
     }
+    hash ^= size;
+    hash ^= hash >> 29;
+    return hash;
+}
 
-    if constexpr (TuneEval::enable_qsearch)
+template<typename T>
+static uint64_t hash_value(const T& value, const uint64_t hash)
+{
+    return hash_bytes(&value, sizeof(value), hash);
+}
+
+// Positions seen by the loader threads when deduplicate_positions is on, keyed on the board's zobrist hash. Only the first
+// copy of a position is quiesced and traced, the others just add their wdl to the position's totals
+class PositionTable
+{
+public:
+    struct Totals
     {
-        board = quiescence_root(parameters, board);
-    }
+        double wdl_sum = 0;
+        double wdl_square_sum = 0;
+        uint64_t count = 0;
+    };
 
-    EvalResult eval_result;
-    if constexpr (TuneEval::supports_external_chess_eval)
+    // Returns true for the first copy of the position
+    bool add(const uint64_t hash, const tune_t wdl)
     {
-        eval_result = TuneEval::get_external_eval_result(board);
+        auto& shard = get_shard(hash);
+        lock_guard<mutex> lock(shard.shard_mutex);
+        auto& totals = shard.positions[hash];
+        totals.wdl_sum += wdl;
+        totals.wdl_square_sum += wdl * wdl;
+        totals.count++;
+        return totals.count == 1;
     }
-    else
+
+    Totals get(const uint64_t hash)
     {
-        auto fen = board.getFen();
-        eval_result = TuneEval::get_fen_eval_result(fen);
+        auto& shard = get_shard(hash);
+        lock_guard<mutex> lock(shard.shard_mutex);
+        return shard.positions[hash];
     }
 
-    Entry entry;
-    //entry.white_to_move = get_fen_color_to_move(fen);
-    entry.white_to_move = board.sideToMove() == chess::Color::WHITE;
-#if TAPERED
-    entry.endgame_scale = eval_result.endgame_scale;
-#endif
-    const bool original_white_to_move = get_fen_color_to_move(original_fen);
-    //cout << (entry.white_to_move ? "w" : "b") << " ";
-    entry.wdl = get_fen_wdl(original_fen, original_white_to_move, entry.white_to_move, side_to_move_wdl);
-    get_coefficient_entries(eval_result.coefficients, entry.coefficients, static_cast<int32_t>(parameters.size()));
-#if TAPERED
-    entry.phase = get_phase(board);
-#endif
-    entry.additional_score = 0;
-    if constexpr (TuneEval::includes_additional_score)
+    size_t size()
     {
-        const tune_t score = linear_eval(entry, parameters);
-        if constexpr (print_data_entries)
+        size_t position_count = 0;
+        for (auto& shard : shards)
         {
-            cout << " Eval: " << score << endl;
+            lock_guard<mutex> lock(shard.shard_mutex);
+            position_count += shard.positions.size();
         }
-        entry.additional_score = eval_result.score - score;
+        return position_count;
+    }
+
+private:
+    struct Shard
+    {
+        mutex shard_mutex;
+        unordered_map<uint64_t, Totals> positions;
+    };
+
+    // The top bits pick the shard, the map itself buckets on the low bits
+    static constexpr size_t shard_bits = 6;
+    array<Shard, 1 << shard_bits> shards;
+
+    Shard& get_shard(const uint64_t hash)
+    {
+        return shards[hash >> (64 - shard_bits)];
+    }
+};
+
+// Everything after decoding a position, shared by the text and the packed sources
+static void add_position(chess::Board& board, const tune_t wdl, const parameters_t& parameters, Dataset& entries, PositionTable& positions, vector<uint64_t>& position_hashes)
+{
+    if constexpr (TuneEval::filter_in_check)
+    {
+        if (board.inCheck())
+            return;
+    }
+
+    entries.count_result(board.sideToMove() == chess::Color::WHITE, wdl);
+
+    // The wdl does not depend on what qsearch does to the board, so copies can be counted before any of the expensive work
+    if constexpr (deduplicate_positions)
+    {
+        const auto hash = board.hash();
+        if (!positions.add(hash, wdl))
+        {
+            return;
+        }
+        position_hashes.push_back(hash);
+    }
+
+    if constexpr (TuneEval::enable_qsearch)
+    {
+        board = quiescence_root(parameters, board);
+    }
+
+    thread_local vector<CoefficientEntry> coefficients;
+    coefficients.clear();
+    const auto eval_result = get_eval_result<TuneEval>(board, coefficients, static_cast<int32_t>(parameters.size()));
+
+    Entry entry;
+    entry.coefficients = coefficients;
+    //entry.white_to_move = get_fen_color_to_move(fen);
+    entry.white_to_move = board.sideToMove() == chess::Color::WHITE;
+#if TAPERED
+    entry.endgame_scale = eval_result.endgame_scale;
+#endif
+    //cout << (entry.white_to_move ? "w" : "b") << " ";
+    entry.wdl = wdl;
+#if TAPERED
+    entry.phase = get_phase(board);
+#endif
+    entry.additional_score = 0;
+    if constexpr (TuneEval::includes_additional_score)
+    {
+        const tune_t score = linear_eval(entry, parameters);
+        if constexpr (print_data_entries)
+        {
+            cout << " Eval: " << score << endl;
+        }
+        entry.additional_score = eval_result.score - score;
     }
 
     entries.push_back(entry);
 }
 
-static void read_fens(const DataSource& source, const high_resolution_clock::time_point start, vector<string>& fens)
+static void parse_fen(const bool side_to_move_wdl, const parameters_t& parameters, Dataset& entries, const string_view original_fen, PositionTable& positions, vector<uint64_t>& position_hashes)
+{
+    if constexpr (print_data_entries)
+    {
+        cout << original_fen;
+    }
+
+    //string fen;
+    const auto clean_fen = cleanup_fen(original_fen);
+    chess::Board board = chess::Board(clean_fen);
+    const bool original_white_to_move = get_fen_color_to_move(original_fen);
+    const tune_t wdl = get_fen_wdl(original_fen, original_white_to_move, original_white_to_move, side_to_move_wdl);
+    add_position(board, wdl, parameters, entries, positions, position_hashes);
+}
+
+// Packed records skip the fen and the wdl marker search, the board is filled in directly
+static void parse_packed_board(const bool side_to_move_wdl, const parameters_t& parameters, Dataset& entries, const string_view record, PositionTable& positions, vector<uint64_t>& position_hashes)
+{
+    thread_local PackedBoard board;
+    tune_t wdl = board.set_packed(record);
+    if (side_to_move_wdl && board.sideToMove() == chess::Color::BLACK)
+    {
+        wdl = 1 - wdl;
+    }
+
+    if constexpr (print_data_entries)
+    {
+        cout << board.getFen();
+    }
+
+    add_position(board, wdl, parameters, entries, positions, position_hashes);
+}
+
+enum class SourceFormat : uint8_t
+{
+    Epd,
+    Packed,
+    Pgn
+};
+
+static bool is_pgn_source(const string& path)
+{
+    return path.ends_with(".pgn") || path.ends_with(".pgn.gz") || path.ends_with(".pgn.zst");
+}
+
+static SourceFormat get_source_format(const DataSource& source)
+{
+    if (PackedBoard::is_packed(source.path))
+    {
+        return SourceFormat::Packed;
+    }
+    if (is_pgn_source(source.path))
+    {
+        return SourceFormat::Pgn;
+    }
+    return SourceFormat::Epd;
+}
+
+struct FenBatch
+{
+    // Lines of epd sources, records of packed ones or whole games of pgn ones
+    vector<string_view> fens;
+    bool side_to_move_wdl;
+    SourceFormat format = SourceFormat::Epd;
+    // Keeps the lines of streamed sources alive, the lines of mapped sources live in the mapping
+    StreamedFile::Block storage;
+    // Set instead of fens for indexed sources, the parser slices lines [first_line, end_line) out of the mapping itself
+    const LineIndex* index = nullptr;
+    const MappedFile* file = nullptr;
+    uint64_t first_line = 0;
+    uint64_t end_line = 0;
+};
+
+static constexpr size_t fen_batch_size = 10000;
+static constexpr size_t pgn_batch_size = 100;
+static constexpr size_t fen_queue_capacity = 2 * data_load_thread_count;
+
+// Compressed sources and pipes are streamed by read_streamed_fens instead, they are only checked here
+static void open_source(const DataSource& source, MappedFile& file)
+{
+    if (get_source_format(source) == SourceFormat::Pgn && source.sampling == SamplingMode::PhaseBalanced)
+    {
+        cout << "Phase balanced sampling picks positions, but PGN sources are sampled by game: " << source.path << endl;
+        throw runtime_error("Phase balanced sampling is not supported for PGN sources");
+    }
+
+    if (StreamedFile::is_streamed(source.path))
+    {
+        if (PackedBoard::is_packed(source.path))
+        {
+            cout << "Packed boards can only be read from a regular file, not " << source.path << endl;
+            throw runtime_error("Packed boards cannot be streamed");
+        }
+        if (!StreamedFile::is_supported(source.path))
+        {
+            cout << "The tuner was built without support for the compression of " << source.path << endl;
+            throw runtime_error("Unsupported data source compression");
+        }
+        return;
+    }
+
+    if (!file.open(source.path))
+    {
+        cout << "Failed to open " << source.path << endl;
+        throw runtime_error("Failed to open data source");
+    }
+}
+
+// Next line of the mapping, without the line break. Returns false at the end of the file
+static bool read_line(const char*& cursor, const char* const file_end, string_view& line)
+{
+    if (cursor >= file_end)
+    {
+        return false;
+    }
+
+    const auto newline = static_cast<const char*>(memchr(cursor, '\n', file_end - cursor));
+    const char* line_end = newline != nullptr ? newline : file_end;
+    line = string_view(cursor, line_end - cursor);
+    if (line.ends_with('\r'))
+    {
+        line.remove_suffix(1);
+    }
+    cursor = line_end + 1;
+    return true;
+}
+
+// Like read_line, but an empty line ends the positions of an epd source too
+static bool next_line(const char*& cursor, const char* const file_end, string_view& line)
+{
+    return read_line(cursor, file_end, line) && !line.empty();
+}
+
+// Draws position_limit lines out of a whole source in one pass. Line is string_view for mapped sources, whose lines stay
+// valid, and string for streamed ones, whose sampled lines have to be copied out of their block. With phase balancing
+// every bucket keeps its own reservoir, and buckets holding fewer positions than their share leave the rest to the others
+template<typename Line>
+class FenSampler
+{
+public:
+    FenSampler(const DataSource& source, mt19937_64& random) :
+        sample_size(static_cast<size_t>(source.position_limit)),
+        format(get_source_format(source)),
+        bucket_count(source.sampling == SamplingMode::PhaseBalanced ? static_cast<size_t>(sampling_phase_buckets) : 1),
+        reservoirs(bucket_count),
+        bucket_line_counts(bucket_count, 0),
+        random(random)
+    {
+    }
+
+    void add(const string_view line)
+    {
+        size_t bucket = 0;
+        if (bucket_count > 1)
+        {
+            const auto phase = format == SourceFormat::Packed ? PackedBoard::get_phase(line) : get_phase(line);
+            bucket = static_cast<size_t>(phase) * bucket_count / 25;
+        }
+
+        auto& reservoir = reservoirs[bucket];
+        const auto seen = bucket_line_counts[bucket]++;
+        if (reservoir.size() < sample_size)
+        {
+            reservoir.emplace_back(line_count, Line(line));
+        }
+        else
+        {
+            const auto slot = uniform_int_distribution<uint64_t>(0, seen)(random);
+            if (slot < sample_size)
+            {
+                reservoir[slot] = { line_count, Line(line) };
+            }
+        }
+        line_count++;
+    }
+
+    int64_t get_line_count() const
+    {
+        return static_cast<int64_t>(line_count);
+    }
+
+    vector<Line> finish()
+    {
+        // Fill the buckets from the smallest up, each taking an equal share of what is still left
+        vector<size_t> bucket_order(bucket_count);
+        for (size_t bucket = 0; bucket < bucket_count; bucket++)
+        {
+            bucket_order[bucket] = bucket;
+        }
+        sort(bucket_order.begin(), bucket_order.end(), [this](const size_t a, const size_t b)
+        {
+            return reservoirs[a].size() < reservoirs[b].size();
+        });
+
+        vector<pair<uint64_t, Line>> picked;
+        auto remaining = sample_size;
+        for (size_t i = 0; i < bucket_count; i++)
+        {
+            auto& reservoir = reservoirs[bucket_order[i]];
+            const auto share = min(reservoir.size(), remaining / (bucket_count - i));
+
+            // The fill order of a reservoir is not random, so a truncated one is shuffled first
+            if (share < reservoir.size())
+            {
+                shuffle(reservoir.begin(), reservoir.end(), random);
+            }
+            move(reservoir.begin(), reservoir.begin() + share, back_inserter(picked));
+            remaining -= share;
+            vector<pair<uint64_t, Line>>().swap(reservoir);
+        }
+
+        // Back in source order, so the parsers walk the file front to back
+        sort(picked.begin(), picked.end(), [](const pair<uint64_t, Line>& a, const pair<uint64_t, Line>& b)
+        {
+            return a.first < b.first;
+        });
+
+        vector<Line> sample;
+        sample.reserve(picked.size());
+        for (auto& line : picked)
+        {
+            sample.push_back(std::move(line.second));
+        }
+        return sample;
+    }
+
+private:
+    const size_t sample_size;
+    const SourceFormat format;
+    const size_t bucket_count;
+    vector<vector<pair<uint64_t, Line>>> reservoirs;
+    vector<uint64_t> bucket_line_counts;
+    uint64_t line_count = 0;
+    mt19937_64& random;
+};
+
+// Uniform sample of line numbers, drawn without touching the file. Floyd's algorithm only needs sample_size draws
+static vector<uint64_t> sample_line_numbers(const uint64_t line_count, const uint64_t sample_size, mt19937_64& random)
+{
+    vector<uint64_t> sample;
+    if (sample_size >= line_count)
+    {
+        sample.resize(line_count);
+        for (uint64_t line = 0; line < line_count; line++)
+        {
+            sample[line] = line;
+        }
+        return sample;
+    }
+
+    unordered_set<uint64_t> picked;
+    picked.reserve(sample_size);
+    for (auto limit = line_count - sample_size; limit < line_count; limit++)
+    {
+        const auto line = uniform_int_distribution<uint64_t>(0, limit)(random);
+        if (!picked.insert(line).second)
+        {
+            picked.insert(limit);
+        }
+    }
+
+    sample.assign(picked.begin(), picked.end());
+    sort(sample.begin(), sample.end());
+    return sample;
+}
+
+// Collects lines into batches for the parsers. Lines of streamed sources point into their block, which
+// the batch keeps alive, so a batch never mixes lines of two blocks
+class FenBatcher
+{
+public:
+    FenBatcher(const DataSource& source, BatchQueue<FenBatch>& batches) :
+        side_to_move_wdl(source.side_to_move_wdl),
+        format(get_source_format(source)),
+        batch_size(format == SourceFormat::Pgn ? pgn_batch_size : fen_batch_size),
+        batches(batches)
+    {
+        current_batch.side_to_move_wdl = side_to_move_wdl;
+        current_batch.format = format;
+    }
+
+    void push(const string_view fen, const StreamedFile::Block& storage = nullptr)
+    {
+        if (storage != current_batch.storage)
+        {
+            flush();
+            current_batch.storage = storage;
+        }
+
+        current_batch.fens.push_back(fen);
+        if (current_batch.fens.size() == batch_size)
+        {
+            flush();
+        }
+    }
+
+    // Hands the lines to the parsers in batch sized ranges, so indexed sources are split by line across the parser threads
+    void push_lines(const LineIndex& index, const MappedFile& file, const uint64_t first_line, const uint64_t end_line)
+    {
+        flush();
+        for (auto batch_start = first_line; batch_start < end_line; batch_start += batch_size)
+        {
+            FenBatch batch;
+            batch.side_to_move_wdl = side_to_move_wdl;
+            batch.format = format;
+            batch.index = &index;
+            batch.file = &file;
+            batch.first_line = batch_start;
+            batch.end_line = min(batch_start + batch_size, end_line);
+            batches.push(std::move(batch));
+        }
+    }
+
+    void flush()
+    {
+        if (!current_batch.fens.empty())
+        {
+            auto storage = current_batch.storage;
+            batches.push(std::move(current_batch));
+            current_batch = FenBatch();
+            current_batch.side_to_move_wdl = side_to_move_wdl;
+            current_batch.format = format;
+            current_batch.storage = storage;
+        }
+    }
+
+private:
+    const bool side_to_move_wdl;
+    const SourceFormat format;
+    const size_t batch_size;
+    BatchQueue<FenBatch>& batches;
+    FenBatch current_batch;
+};
+
+static void print_read_header(const DataSource& source)
 {
     cout << "Reading " << source.path;
     if (source.position_limit > 0)
     {
-        cout << " (" << source.position_limit << " positions)";
+        cout << " (" << source.position_limit << (get_source_format(source) == SourceFormat::Pgn ? " games" : " positions");
+        if (source.sampling == SamplingMode::Random)
+        {
+            cout << ", random sample";
+        }
+        else if (source.sampling == SamplingMode::PhaseBalanced)
+        {
+            cout << ", phase balanced sample";
+        }
+        cout << ")";
     }
     cout << "..." << endl;
+}
 
-    ifstream file(source.path);
-    if (!file)
+static bool is_sampled(const DataSource& source)
+{
+    return source.position_limit > 0 && source.sampling != SamplingMode::Prefix;
+}
+
+static bool get_pgn_result(const string_view token, tune_t& wdl)
+{
+    for (const auto& marker : markers)
     {
-        cout << "Failed to open " << source.path << endl;
-        throw runtime_error("Failed to open data source");
+        if (token == marker.marker)
+        {
+            wdl = marker.wdl;
+            return true;
+        }
     }
+    return false;
+}
 
-    while (!file.eof())
+// Replays a game from its movetext and adds its positions, before each move, with the game result as their wdl.
+// Comments, variations and annotations are skipped. A move that does not parse ends the game at that point
+static void parse_pgn_game(const bool side_to_move_wdl, const parameters_t& parameters, Dataset& entries, const string_view game, PositionTable& positions, vector<uint64_t>& position_hashes)
+{
+    thread_local vector<chess::Move> moves;
+    moves.clear();
+    chess::Board start_board;
+    chess::Board board;
+    tune_t wdl = 0;
+    bool has_result = false;
+    bool in_movetext = false;
+
+    size_t i = 0;
+    while (i < game.size())
     {
-        if (source.position_limit > 0 && fens.size() >= source.position_limit)
+        const auto c = game[i];
+        if (isspace(static_cast<unsigned char>(c)))
         {
-            break;
+            i++;
+            continue;
+        }
+
+        if (c == '[')
+        {
+            const auto tag_end = min(game.find(']', i), game.size());
+            const auto tag = game.substr(i + 1, tag_end - i - 1);
+            i = tag_end + 1;
+
+            const auto value_begin = tag.find('"');
+            const auto value_end = tag.rfind('"');
+            if (in_movetext || value_begin == string_view::npos || value_end <= value_begin)
+            {
+                continue;
+            }
+            const auto name = tag.substr(0, tag.find(' '));
+            const auto value = tag.substr(value_begin + 1, value_end - value_begin - 1);
+            if (name == "Result")
+            {
+                has_result = get_pgn_result(value, wdl);
+            }
+            else if (name == "FEN")
+            {
+                board.setFen(value);
+                start_board = board;
+            }
+            continue;
+        }
+
+        in_movetext = true;
+        if (c == '{')
+        {
+            i = min(game.find('}', i), game.size()) + 1;
+            continue;
+        }
+        if (c == ';')
+        {
+            i = min(game.find('\n', i), game.size()) + 1;
+            continue;
+        }
+        if (c == '(')
+        {
+            int32_t depth = 0;
+            for (; i < game.size(); i++)
+            {
+                depth += game[i] == '(' ? 1 : game[i] == ')' ? -1 : 0;
+                if (depth == 0)
+                {
+                    break;
+                }
+            }
+            i++;
+            continue;
+        }
+
+        auto token_end = i;
+        while (token_end < game.size() && !isspace(static_cast<unsigned char>(game[token_end])) && string_view("{}();[").find(game[token_end]) == string_view::npos)
+        {
+            token_end++;
         }
+        auto token = game.substr(i, token_end - i);
+        i = token_end;
 
-        string original_fen;
-        getline(file, original_fen);
-        if (original_fen.empty())
+        tune_t token_wdl;
+        if (get_pgn_result(token, token_wdl))
         {
+            if (!has_result)
+            {
+                wdl = token_wdl;
+                has_result = true;
+            }
             break;
         }
+        if (token == "*" || token.starts_with('$'))
+        {
+            continue;
+        }
+
+        // Move numbers, also when glued to the move as in 12.e4. Castling written as 0-0 starts with a digit too
+        const auto last_dot = token.rfind('.');
+        if (last_dot != string_view::npos)
+        {
+            token.remove_prefix(last_dot + 1);
+        }
+        else if (token.find_first_not_of("0123456789") == string_view::npos)
+        {
+            continue;
+        }
+        while (!token.empty() && string_view("+#!?").find(token.back()) != string_view::npos)
+        {
+            token.remove_suffix(1);
+        }
+        if (token.empty())
+        {
+            continue;
+        }
+
+        chess::Move move;
+        try
+        {
+            move = chess::uci::parseSan(board, token);
+        }
+        catch (const chess::uci::SanParseError&)
+        {
+            break;
+        }
+        moves.push_back(move);
+        board.makeMove(move);
+    }
+
+    if (!has_result)
+    {
+        return;
+    }
+
+    // Skip the opening plies, then either take every position or a sample seeded by the game itself
+    const auto first_ply = min(static_cast<size_t>(pgn_skip_plies), moves.size());
+    const auto candidate_count = moves.size() - first_ply;
+    thread_local vector<uint64_t> plies;
+    if (pgn_positions_per_game > 0 && candidate_count > static_cast<size_t>(pgn_positions_per_game))
+    {
+        mt19937_64 random(hash_bytes(game.data(), game.size(), sampling_seed));
+        plies = sample_line_numbers(candidate_count, pgn_positions_per_game, random);
+    }
+    else
+    {
+        plies.resize(candidate_count);
+        for (size_t ply = 0; ply < candidate_count; ply++)
+        {
+            plies[ply] = ply;
+        }
+    }
+
+    board = start_board;
+    size_t next_ply = 0;
+    for (size_t ply = 0; ply < moves.size() && next_ply < plies.size(); ply++)
+    {
+        if (ply == first_ply + plies[next_ply])
+        {
+            chess::Board position = board;
+            const auto position_wdl = side_to_move_wdl && position.sideToMove() == chess::Color::BLACK ? 1 - wdl : wdl;
+            add_position(position, position_wdl, parameters, entries, positions, position_hashes);
+            next_ply++;
+        }
+        board.makeMove(moves[ply]);
+    }
+}
+
+static void read_fens(const DataSource& source, const high_resolution_clock::time_point start, const MappedFile& file, const LineIndex* index, mt19937_64& random, BatchQueue<FenBatch>& batches)
+{
+    print_read_header(source);
+    const bool sampled = is_sampled(source);
+    FenBatcher batcher(source, batches);
+
+    // Lines are sliced directly out of the mapping, nothing is copied until the entries are built
+    int64_t fen_count = 0;
+    if (index != nullptr && source.sampling != SamplingMode::PhaseBalanced)
+    {
+        // With an index neither the limit nor a random sample needs a pass over the file, this thread never reads the
+        // positions themselves and leaves all page faults to the parsers. Without sampling it does not even slice the
+        // lines, each parser takes whole line ranges of the file
+        const auto line_count = static_cast<uint64_t>(index->size());
+        const auto limit = source.position_limit > 0 ? min(line_count, static_cast<uint64_t>(source.position_limit)) : line_count;
+        if (sampled)
+        {
+            for (const auto line : sample_line_numbers(line_count, limit, random))
+            {
+                batcher.push(index->line(file, line));
+            }
+            print_elapsed(start);
+            cout << "Sampled " << limit << " of " << line_count << " positions" << endl;
+        }
+        else
+        {
+            batcher.push_lines(*index, file, 0, limit);
+        }
+        fen_count = static_cast<int64_t>(limit);
+    }
+    else
+    {
+        const char* cursor = file.data();
+        const char* const file_end = cursor + file.size();
+        string_view original_fen;
+        if (sampled)
+        {
+            FenSampler<string_view> sampler(source, random);
+            while (next_line(cursor, file_end, original_fen))
+            {
+                sampler.add(original_fen);
+            }
+            for (const auto fen : sampler.finish())
+            {
+                batcher.push(fen);
+                fen_count++;
+            }
+            print_elapsed(start);
+            cout << "Sampled " << fen_count << " of " << sampler.get_line_count() << " positions" << endl;
+        }
+        else
+        {
+            while ((source.position_limit <= 0 || fen_count < source.position_limit) && next_line(cursor, file_end, original_fen))
+            {
+                batcher.push(original_fen);
+                fen_count++;
+            }
+        }
+    }
+    batcher.flush();
+
+    print_elapsed(start);
+    std::cout << "Read " << fen_count << " positions from " << source.path << endl;
+}
+
+// Sampled lines of a stream do not outlive their blocks, so they are packed into one block of their own
+static void push_copied_sample(FenBatcher& batcher, const vector<string>& sample)
+{
+    size_t sample_size = 0;
+    for (const auto& fen : sample)
+    {
+        sample_size += fen.size();
+    }
+    auto storage = make_shared<vector<char>>();
+    storage->reserve(sample_size);
+    for (const auto& fen : sample)
+    {
+        storage->insert(storage->end(), fen.begin(), fen.end());
+    }
+
+    const StreamedFile::Block sample_block = storage;
+    const char* cursor = storage->data();
+    for (const auto& fen : sample)
+    {
+        batcher.push(string_view(cursor, fen.size()), sample_block);
+        cursor += fen.size();
+    }
+    batcher.flush();
+}
+
+// Streamed sources are read and decompressed on their own thread while this one cuts the blocks into batches
+static void read_streamed_fens(const DataSource& source, const high_resolution_clock::time_point start, mt19937_64& random, BatchQueue<FenBatch>& batches)
+{
+    print_read_header(source);
+    StreamedFile file;
+    if (!file.open(source.path))
+    {
+        cout << "Failed to open " << source.path << endl;
+        throw runtime_error("Failed to open data source");
+    }
+
+    const bool sampled = is_sampled(source);
+    FenSampler<string> sampler(source, random);
+    FenBatcher batcher(source, batches);
+    int64_t fen_count = 0;
+    bool reached_end = false;
+    StreamedFile::Block block;
+    while (!reached_end && file.read(block))
+    {
+        const char* cursor = block->data();
+        const char* const block_end = cursor + block->size();
+        string_view original_fen;
+        while (true)
+        {
+            if (!sampled && source.position_limit > 0 && fen_count >= source.position_limit)
+            {
+                reached_end = true;
+                break;
+            }
+            const bool block_done = cursor >= block_end;
+            if (!next_line(cursor, block_end, original_fen))
+            {
+                // An empty line ends the source, the end of a block does not
+                reached_end = !block_done;
+                break;
+            }
+
+            if (sampled)
+            {
+                sampler.add(original_fen);
+            }
+            else
+            {
+                batcher.push(original_fen, block);
+                fen_count++;
+            }
+        }
+    }
+    batcher.flush();
+    file.close();
+    if (file.failed())
+    {
+        cout << "Failed to read " << source.path << endl;
+        throw runtime_error("Failed to read data source");
+    }
+
+    if (sampled)
+    {
+        const auto sample = sampler.finish();
+        push_copied_sample(batcher, sample);
+        fen_count = static_cast<int64_t>(sample.size());
+        print_elapsed(start);
+        cout << "Sampled " << fen_count << " of " << sampler.get_line_count() << " positions" << endl;
+    }
+
+    print_elapsed(start);
+    std::cout << "Read " << fen_count << " positions from " << source.path << endl;
+}
+
+// Gives every deduplicated entry the mean wdl and the count of all copies of its position. A count beyond the 16 bit weight
+// continues in copies of the entry, and the wdl spread between the copies goes into error_offset like in merge_duplicate_rows
+static void apply_position_totals(Dataset& entries, const vector<uint64_t>& position_hashes, PositionTable& positions)
+{
+    vector<CoefficientEntry> coefficients;
+    const auto unique_count = entries.size();
+    for (size_t i = 0; i < unique_count; i++)
+    {
+        const auto totals = positions.get(position_hashes[i]);
+        const auto mean_wdl = static_cast<float>(totals.wdl_sum / static_cast<double>(totals.count));
+        entries.error_offset += totals.wdl_square_sum - static_cast<double>(totals.count) * mean_wdl * mean_wdl;
+
+        auto& header = entries.headers[i];
+        header.wdl = mean_wdl;
+        header.weight = static_cast<uint16_t>(min<uint64_t>(totals.count, max_entry_weight));
+
+        auto remaining = totals.count - header.weight;
+        while (remaining > 0)
+        {
+            auto entry = entries[i];
+            coefficients.assign(entry.coefficients.begin(), entry.coefficients.end());
+            entry.coefficients = coefficients;
+            entry.weight = static_cast<tune_t>(min<uint64_t>(remaining, max_entry_weight));
+            entries.push_back(entry);
+            remaining -= static_cast<uint64_t>(entry.weight);
+        }
+    }
+
+    entries.weight_sum = 0;
+    for (const auto& header : entries.headers)
+    {
+        entries.weight_sum += header.weight;
+    }
+}
+
+// Packed records have a fixed size, so limits and random samples pick records directly without any index
+static void read_packed_boards(const DataSource& source, const high_resolution_clock::time_point start, const MappedFile& file, mt19937_64& random, BatchQueue<FenBatch>& batches)
+{
+    print_read_header(source);
+    if (file.size() % PackedBoard::record_size != 0)
+    {
+        cout << source.path << " is not a whole number of " << PackedBoard::record_size << " byte packed boards" << endl;
+        throw runtime_error("Packed data source has a partial record");
+    }
+
+    const auto record_count = static_cast<uint64_t>(file.size() / PackedBoard::record_size);
+    const auto limit = source.position_limit > 0 ? min(record_count, static_cast<uint64_t>(source.position_limit)) : record_count;
+    const auto get_record = [&file](const uint64_t record)
+    {
+        return string_view(file.data() + record * PackedBoard::record_size, PackedBoard::record_size);
+    };
+
+    FenBatcher batcher(source, batches);
+    int64_t fen_count = 0;
+    if (!is_sampled(source))
+    {
+        for (uint64_t record = 0; record < limit; record++)
+        {
+            batcher.push(get_record(record));
+        }
+        fen_count = static_cast<int64_t>(limit);
+    }
+    else
+    {
+        if (source.sampling == SamplingMode::Random)
+        {
+            for (const auto record : sample_line_numbers(record_count, limit, random))
+            {
+                batcher.push(get_record(record));
+            }
+            fen_count = static_cast<int64_t>(limit);
+        }
+        else
+        {
+            FenSampler<string_view> sampler(source, random);
+            for (uint64_t record = 0; record < record_count; record++)
+            {
+                sampler.add(get_record(record));
+            }
+            for (const auto fen : sampler.finish())
+            {
+                batcher.push(fen);
+                fen_count++;
+            }
+        }
+        print_elapsed(start);
+        cout << "Sampled " << fen_count << " of " << record_count << " positions" << endl;
+    }
+    batcher.flush();
+
+    print_elapsed(start);
+    std::cout << "Read " << fen_count << " positions from " << source.path << endl;
+}
+
+// Cuts pgn text into games, a game runs from its first tag pair up to the tag pairs of the next one. Games are views into
+// the text they were read from, only a game spanning two blocks of a streamed source is copied into a block of its own
+class PgnSplitter
+{
+public:
+    using GameCallback = function<void(string_view game, const StreamedFile::Block& storage)>;
+
+    explicit PgnSplitter(GameCallback emit_game) : emit_game(std::move(emit_game))
+    {
+    }
+
+    void add_line(const string_view line, const StreamedFile::Block& storage)
+    {
+        if (line.starts_with('[') && has_movetext)
+        {
+            finish();
+        }
+
+        const bool blank = line.find_first_not_of(" \t") == string_view::npos;
+        if (!in_game)
+        {
+            if (blank)
+            {
+                return;
+            }
+            in_game = true;
+            game_begin = line.data();
+            game_end = line.data() + line.size();
+            game_storage = storage;
+        }
+        else if (carry.empty() && storage == game_storage)
+        {
+            game_end = line.data() + line.size();
+        }
+        else
+        {
+            if (carry.empty())
+            {
+                carry.assign(game_begin, game_end);
+            }
+            carry += '\n';
+            carry += line;
+        }
+
+        if (!blank && !line.starts_with('['))
+        {
+            has_movetext = true;
+        }
+    }
+
+    void finish()
+    {
+        if (!in_game)
+        {
+            return;
+        }
+
+        if (carry.empty())
+        {
+            emit_game(string_view(game_begin, game_end - game_begin), game_storage);
+        }
+        else
+        {
+            const StreamedFile::Block block = make_shared<const vector<char>>(carry.begin(), carry.end());
+            emit_game(string_view(block->data(), block->size()), block);
+            carry.clear();
+        }
+        in_game = false;
+        has_movetext = false;
+    }
+
+private:
+    GameCallback emit_game;
+    bool in_game = false;
+    bool has_movetext = false;
+    const char* game_begin = nullptr;
+    const char* game_end = nullptr;
+    StreamedFile::Block game_storage;
+    string carry;
+};
+
+// For pgn sources position_limit and sampling count games, the positions are picked per game by parse_pgn_game
+static void read_pgn_games(const DataSource& source, const high_resolution_clock::time_point start, const MappedFile* file, mt19937_64& random, BatchQueue<FenBatch>& batches)
+{
+    print_read_header(source);
+    const bool sampled = is_sampled(source);
+    FenSampler<string> sampler(source, random);
+    FenBatcher batcher(source, batches);
+    int64_t game_count = 0;
+    PgnSplitter splitter([&](const string_view game, const StreamedFile::Block& storage)
+    {
+        if (sampled)
+        {
+            sampler.add(game);
+        }
+        else
+        {
+            batcher.push(game, storage);
+            game_count++;
+        }
+    });
+    const auto limit_reached = [&]()
+    {
+        return !sampled && source.position_limit > 0 && game_count >= source.position_limit;
+    };
+
+    string_view line;
+    if (file != nullptr)
+    {
+        const char* cursor = file->data();
+        const char* const file_end = cursor + file->size();
+        while (!limit_reached() && read_line(cursor, file_end, line))
+        {
+            splitter.add_line(line, nullptr);
+        }
+    }
+    else
+    {
+        StreamedFile stream;
+        if (!stream.open(source.path))
+        {
+            cout << "Failed to open " << source.path << endl;
+            throw runtime_error("Failed to open data source");
+        }
+
+        StreamedFile::Block block;
+        while (!limit_reached() && stream.read(block))
+        {
+            const char* cursor = block->data();
+            const char* const block_end = cursor + block->size();
+            while (!limit_reached() && read_line(cursor, block_end, line))
+            {
+                splitter.add_line(line, block);
+            }
+        }
+        stream.close();
+        if (stream.failed())
+        {
+            cout << "Failed to read " << source.path << endl;
+            throw runtime_error("Failed to read data source");
+        }
+    }
+    if (!limit_reached())
+    {
+        splitter.finish();
+    }
+    batcher.flush();
+
+    if (sampled)
+    {
+        const auto sample = sampler.finish();
+        push_copied_sample(batcher, sample);
+        game_count = static_cast<int64_t>(sample.size());
+        print_elapsed(start);
+        cout << "Sampled " << game_count << " of " << sampler.get_line_count() << " games" << endl;
+    }
+
+    print_elapsed(start);
+    std::cout << "Read " << game_count << " games from " << source.path << endl;
+}
+
+// Loads the sidecar index of a source, or builds and saves it when it is missing or out of date
+static void get_line_index(ThreadPool& thread_pool, const DataSource& source, const MappedFile& file, const high_resolution_clock::time_point time_start, LineIndex& index)
+{
+    const auto index_path = source.path + ".idx";
+    if (index.load(index_path, source.path, file))
+    {
+        return;
+    }
+
+    index.build(thread_pool, source.path, file);
+    print_elapsed(time_start);
+    cout << "Indexed " << index.size() << " lines of " << source.path << endl;
+    if (!index.save(index_path))
+    {
+        cout << "Failed to save line index " << index_path << endl;
+    }
+}
+
+static void load_fens(ThreadPool& thread_pool, const vector<DataSource>& sources, const parameters_t& parameters, const high_resolution_clock::time_point time_start, Dataset& entries)
+{
+    // The mappings have to outlive the parsers, the batches only hold views into them
+    vector<MappedFile> files(sources.size());
+    for (size_t source_index = 0; source_index < sources.size(); source_index++)
+    {
+        open_source(sources[source_index], files[source_index]);
+    }
+
+    // Indexes are built before the parsers occupy the pool, so the newline scan gets every thread
+    vector<LineIndex> indexes(use_line_index ? sources.size() : 0);
+    for (size_t source_index = 0; source_index < indexes.size(); source_index++)
+    {
+        if (StreamedFile::is_streamed(sources[source_index].path) || get_source_format(sources[source_index]) != SourceFormat::Epd)
+        {
+            continue;
+        }
+        get_line_index(thread_pool, sources[source_index], files[source_index], time_start, indexes[source_index]);
+    }
+
+    array<Dataset, data_load_thread_count> thread_entries;
+    array<vector<uint64_t>, data_load_thread_count> thread_position_hashes;
+    PositionTable positions;
+    BatchQueue<FenBatch> batches(fen_queue_capacity);
+    TaskGroup parsers;
+
+    // Parsers start consuming while the reader below is still scanning the files. All sources share one queue,
+    // so the parsers only drain once the last batch of the last source has been handed out
+    for (int thread_id = 0; thread_id < data_load_thread_count; thread_id++)
+    {
+        thread_pool.enqueue(parsers, [thread_id, &thread_entries, &thread_position_hashes, &positions, &batches, &parameters, time_start]()
+        {
+            Dataset entries;
+            auto& position_hashes = thread_position_hashes[thread_id];
+
+            int position_count = 0;
+            FenBatch thread_batch;
+            while(batches.pop(thread_batch))
+            {
+                constexpr auto thread_data_load_print_interval = TuneEval::data_load_print_interval / data_load_thread_count;
+                const auto parse = [&](const string_view fen)
+                {
+                    switch (thread_batch.format)
+                    {
+                    case SourceFormat::Epd:
+                        parse_fen(thread_batch.side_to_move_wdl, parameters, entries, fen, positions, position_hashes);
+                        break;
+                    case SourceFormat::Packed:
+                        parse_packed_board(thread_batch.side_to_move_wdl, parameters, entries, fen, positions, position_hashes);
+                        break;
+                    case SourceFormat::Pgn:
+                        parse_pgn_game(thread_batch.side_to_move_wdl, parameters, entries, fen, positions, position_hashes);
+                        break;
+                    }
+                    position_count++;
+                    if (thread_id == 0 && position_count % thread_data_load_print_interval == 0)
+                    {
+                        print_elapsed(time_start);
+                        std::cout << "Parsed ~" << position_count * data_load_thread_count << " positions..." << endl;
+                    }
+                };
+
+                if (thread_batch.index != nullptr)
+                {
+                    for (auto line = thread_batch.first_line; line < thread_batch.end_line; line++)
+                    {
+                        parse(thread_batch.index->line(*thread_batch.file, line));
+                    }
+                }
+                else
+                {
+                    for (const auto fen : thread_batch.fens)
+                    {
+                        parse(fen);
+                    }
+                }
+            }
+
+            thread_entries[thread_id] = std::move(entries);
+        });
+    }
+
+    // One generator for all sources, read in order, so a sample only depends on the seed and the source list
+    mt19937_64 random(sampling_seed);
+    try
+    {
+        for (size_t source_index = 0; source_index < sources.size(); source_index++)
+        {
+            if (get_source_format(sources[source_index]) == SourceFormat::Pgn)
+            {
+                const auto file = StreamedFile::is_streamed(sources[source_index].path) ? nullptr : &files[source_index];
+                read_pgn_games(sources[source_index], time_start, file, random, batches);
+                continue;
+            }
+            if (StreamedFile::is_streamed(sources[source_index].path))
+            {
+                read_streamed_fens(sources[source_index], time_start, random, batches);
+                continue;
+            }
+            if (PackedBoard::is_packed(sources[source_index].path))
+            {
+                read_packed_boards(sources[source_index], time_start, files[source_index], random, batches);
+                continue;
+            }
+
+            const auto index = use_line_index ? &indexes[source_index] : nullptr;
+            read_fens(sources[source_index], time_start, files[source_index], index, random, batches);
+        }
+    }
+    catch (...)
+    {
+        // The parsers hold references into this frame, they have to stop before the error leaves it
+        batches.close();
+        thread_pool.wait(parsers);
+        throw;
+    }
+    batches.close();
+    thread_pool.wait(parsers);
+
+    // Only now are the totals of every position complete
+    if constexpr (deduplicate_positions)
+    {
+        thread_pool.parallel_for(0, data_load_thread_count, 1, [&thread_entries, &thread_position_hashes, &positions](const size_t start, const size_t end, const uint32_t)
+        {
+            for (auto thread_id = start; thread_id < end; thread_id++)
+            {
+                apply_position_totals(thread_entries[thread_id], thread_position_hashes[thread_id], positions);
+                vector<uint64_t>().swap(thread_position_hashes[thread_id]);
+            }
+        });
+        print_elapsed(time_start);
+        cout << "Kept " << positions.size() << " unique positions" << endl;
+    }
+
+    for (int thread_id = 0; thread_id < data_load_thread_count; thread_id++)
+    {
+        entries.append(thread_entries[thread_id]);
+        thread_entries[thread_id] = Dataset();
+    }
+}
+
+struct DataCacheHeader
+{
+    array<char, 8> magic;
+    uint32_t version;
+    uint32_t tune_size;
+    uint64_t key;
+    uint64_t entry_count;
+    uint64_t coefficient_count;
+    uint64_t weight_sum;
+    double error_offset;
+    result_counts_t result_counts;
+};
+
+static constexpr array<char, 8> data_cache_magic = { 'T', 'U', 'N', 'E', 'D', 'A', 'T', 'A' };
+static constexpr uint32_t data_cache_version = 7;
+
+// Anything that changes what parse_fen produces has to be part of the key
+template<typename T>
+concept VersionedTraceEval = requires
+{
+    { T::trace_version } -> convertible_to<int64_t>;
+};
+
+// Evals without a trace_version are treated as version 0
+template<typename Eval>
+static constexpr int64_t get_trace_version()
+{
+    if constexpr (VersionedTraceEval<Eval>)
+    {
+        return Eval::trace_version;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+static uint64_t get_data_cache_key(const vector<DataSource>& sources, const parameters_t& parameters)
+{
+    uint64_t key = hash_value(data_cache_version, hash_seed);
+    key = hash_value(parameters.size(), key);
+    key = hash_bytes(parameters.data(), parameters.size() * sizeof(parameters[0]), key);
+    key = hash_value(TAPERED, key);
+    key = hash_value(TuneEval::enable_qsearch, key);
+    key = hash_value(TuneEval::filter_in_check, key);
+    key = hash_value(TuneEval::includes_additional_score, key);
+    key = hash_value(get_trace_version<TuneEval>(), key);
+    key = hash_value(compress_coefficients, key);
+    key = hash_value(merge_duplicate_entries, key);
+    key = hash_value(deduplicate_positions, key);
+
+    for (const auto& source : sources)
+    {
+        MappedFile file;
+        if (!file.open(source.path))
+        {
+            cout << "Failed to open " << source.path << endl;
+            throw runtime_error("Failed to open data source");
+        }
+
+        key = hash_bytes(file.data(), file.size(), key);
+        key = hash_value(source.side_to_move_wdl, key);
+        key = hash_value(source.position_limit, key);
+        if (source.position_limit > 0 && source.sampling != SamplingMode::Prefix)
+        {
+            key = hash_value(source.sampling, key);
+            key = hash_value(sampling_seed, key);
+            key = hash_value(sampling_phase_buckets, key);
+            key = hash_value(use_line_index, key);
+        }
+        if (get_source_format(source) == SourceFormat::Pgn)
+        {
+            key = hash_value(pgn_skip_plies, key);
+            key = hash_value(pgn_positions_per_game, key);
+            key = hash_value(sampling_seed, key);
+        }
+    }
+
+    return key;
+}
+
+static string get_data_cache_path(const uint64_t key)
+{
+    stringstream path;
+    path << data_cache_directory << "/tuner_cache_" << hex << setw(16) << setfill('0') << key << ".bin";
+    return path.str();
+}
+
+template<typename T>
+static void read_cache_section(const char*& cursor, const char* const end, const size_t count, vector<T>& section)
+{
+    const auto section_size = count * sizeof(T);
+    if (static_cast<size_t>(end - cursor) < section_size)
+    {
+        throw runtime_error("Data cache is truncated");
+    }
+    section.resize(count);
+    memcpy(section.data(), cursor, section_size);
+    cursor += section_size;
+}
+
+static bool load_data_cache(const string& path, const uint64_t key, Dataset& entries)
+{
+    MappedFile file;
+    if (!file.open(path) || file.size() < sizeof(DataCacheHeader))
+    {
+        return false;
+    }
+
+    DataCacheHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    if (header.magic != data_cache_magic || header.version != data_cache_version || header.tune_size != sizeof(tune_t) || header.key != key)
+    {
+        return false;
+    }
+
+    // The sections are laid out exactly like the Dataset arrays, so each one is a single copy out of the mapping
+    const char* cursor = file.data() + sizeof(header);
+    const char* const end = file.data() + file.size();
+    read_cache_section(cursor, end, header.entry_count + 1, entries.offsets);
+    read_cache_section(cursor, end, header.coefficient_count, entries.coefficients);
+    read_cache_section(cursor, end, header.entry_count, entries.headers);
+    entries.weight_sum = header.weight_sum;
+    entries.error_offset = header.error_offset;
+    entries.result_counts = header.result_counts;
+
+    if (entries.offsets.front() != 0 || entries.offsets.back() != header.coefficient_count)
+    {
+        throw runtime_error("Data cache is corrupt");
+    }
+
+    return true;
+}
+
+template<typename T>
+static void write_cache_section(ofstream& file, const vector<T>& section)
+{
+    file.write(reinterpret_cast<const char*>(section.data()), static_cast<streamsize>(section.size() * sizeof(T)));
+}
+
+static void save_data_cache(const string& path, const uint64_t key, const Dataset& entries)
+{
+    DataCacheHeader header;
+    header.magic = data_cache_magic;
+    header.version = data_cache_version;
+    header.tune_size = sizeof(tune_t);
+    header.key = key;
+    header.entry_count = entries.size();
+    header.coefficient_count = entries.coefficients.size();
+    header.weight_sum = entries.weight_sum;
+    header.error_offset = entries.error_offset;
+    header.result_counts = entries.result_counts;
+
+    // Written under a temporary name first so an interrupted run never leaves a truncated cache behind
+    const auto temporary_path = path + ".tmp";
+    {
+        ofstream file(temporary_path, ios::binary | ios::trunc);
+        if (!file)
+        {
+            cout << "Failed to create data cache " << temporary_path << endl;
+            return;
+        }
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_cache_section(file, entries.offsets);
+        write_cache_section(file, entries.coefficients);
+        write_cache_section(file, entries.headers);
+        if (!file)
+        {
+            cout << "Failed to write data cache " << temporary_path << endl;
+            return;
+        }
+    }
+
+    remove(path.c_str());
+    if (rename(temporary_path.c_str(), path.c_str()) != 0)
+    {
+        cout << "Failed to move data cache to " << path << endl;
+        return;
+    }
+
+    cout << "Saved data cache " << path << endl;
+}
+
+static tune_t sigmoid(const tune_t K, const tune_t eval)
+{
+    return static_cast<tune_t>(1) / (static_cast<tune_t>(1) + exp(-K * eval / static_cast<tune_t>(400)));
+}
+
+// Entries per parallel_for chunk for the passes over the whole dataset
+static constexpr size_t entry_chunk_size = 4096;
+
+// Compensated running sum, keeps long single precision accumulations close to what the double build gets
+struct KahanSum
+{
+    tune_t sum = 0;
+    tune_t compensation = 0;
+
+    void add(const tune_t value)
+    {
+        const auto compensated = value - compensation;
+        const auto total = sum + compensated;
+        compensation = (total - sum) - compensated;
+        sum = total;
+    }
+
+    tune_t get() const
+    {
+        return sum - compensation;
+    }
+};
+
+// Hash of everything that decides an entry's eval: its coefficients, phase, endgame scale and additional score.
+// The side to move is part of it too, so merged entries keep a side for the statistics
+static uint64_t get_row_hash(const Dataset& entries, const size_t index)
+{
+    const auto& header = entries.headers[index];
+    const auto begin = entries.coefficients.data() + entries.offsets[index];
+    const auto size = (entries.offsets[index + 1] - entries.offsets[index]) * sizeof(coefficient_storage_t);
+    auto hash = hash_bytes(begin, size, hash_seed);
+    hash = hash_value(header.phase, hash);
+    hash = hash_value(header.endgame_scale, hash);
+    hash = hash_value(header.additional_score, hash);
+    hash = hash_value(header.flags, hash);
+    return hash;
+}
 
-        fens.push_back(original_fen);
+static bool rows_equal(const Dataset& entries, const size_t left, const size_t right)
+{
+    const auto& left_header = entries.headers[left];
+    const auto& right_header = entries.headers[right];
+    if (left_header.phase != right_header.phase || left_header.endgame_scale != right_header.endgame_scale || left_header.additional_score != right_header.additional_score
+        || left_header.flags != right_header.flags)
+    {
+        return false;
     }
 
-    print_elapsed(start);
-    std::cout << "Read " << fens.size() << " positions from " << source.path << endl;
+    const auto left_size = entries.offsets[left + 1] - entries.offsets[left];
+    const auto right_size = entries.offsets[right + 1] - entries.offsets[right];
+    return left_size == right_size && memcmp(entries.coefficients.data() + entries.offsets[left], entries.coefficients.data() + entries.offsets[right], left_size * sizeof(coefficient_storage_t)) == 0;
 }
 
-static void parse_fens(ThreadPool& thread_pool, const DataSource& source, const vector<string>& fens, const parameters_t& parameters, const high_resolution_clock::time_point time_start, vector<Entry>& entries)
+// Entries with identical rows have the same eval, so for MSE they collapse exactly into one entry weighted by their count,
+// holding their mean wdl. What is left of the squared error, the spread of the wdls around that mean, does not depend on
+// the parameters and moves into error_offset so the reported error stays the same
+static void merge_duplicate_rows(ThreadPool& thread_pool, Dataset& entries)
 {
-    cout << "Parsing " << fens.size() << " positions..." << endl;
-    array<vector<Entry>, data_load_thread_count> thread_entries;
-    const auto side_to_move_wdl = source.side_to_move_wdl;
-    constexpr int batch_size = 10000;
-    mutex mut;
-    queue<vector<string>> batches;
-    vector<string> current_batch;
-    for(const auto& fen : fens)
+    const auto count = entries.size();
+    vector<uint64_t> hashes(count);
+    thread_pool.parallel_for(0, count, entry_chunk_size, [&hashes, &entries](const size_t start, const size_t end, const uint32_t)
     {
-        current_batch.push_back(fen);
-        if (current_batch.size() == batch_size)
+        for (auto i = start; i < end; i++)
         {
-            batches.emplace(current_batch);
-            current_batch.clear();
+            hashes[i] = get_row_hash(entries, i);
         }
-    }
-    if(!current_batch.empty())
+    });
+
+    // Shards by hash are grouped in parallel. Within a shard the rows are sorted by hash and then index,
+    // so the first row of every group is its lowest index and becomes the leader
+    constexpr size_t shard_count = 256;
+    vector<vector<size_t>> shards(shard_count);
+    for (size_t i = 0; i < count; i++)
     {
-        batches.emplace(current_batch);
+        shards[hashes[i] % shard_count].push_back(i);
     }
 
-    for (int thread_id = 0; thread_id < data_load_thread_count; thread_id++)
+    vector<size_t> leaders(count);
+    thread_pool.parallel_for(0, shard_count, 1, [&shards, &hashes, &leaders, &entries](const size_t start, const size_t end, const uint32_t)
     {
-        thread_pool.enqueue([thread_id, &thread_entries, &mut, side_to_move_wdl, parameters, &batches, time_start]()
+        for (auto shard_index = start; shard_index < end; shard_index++)
         {
-            vector<Entry> entries;
+            auto& shard = shards[shard_index];
+            sort(shard.begin(), shard.end(), [&hashes](const size_t left, const size_t right)
+            {
+                return hashes[left] != hashes[right] ? hashes[left] < hashes[right] : left < right;
+            });
 
-            int position_count = 0;
-            while(true)
+            size_t run_start = 0;
+            for (size_t position = 0; position < shard.size(); position++)
             {
-                vector<string> thread_batch;
+                const auto index = shard[position];
+                if (hashes[index] != hashes[shard[run_start]])
                 {
-                    lock_guard lock(mut);
-                    if(batches.empty())
-                    {
-                        break;
-                    }
-                    thread_batch = batches.front();
-                    batches.pop();
+                    run_start = position;
                 }
 
-                constexpr auto thread_data_load_print_interval = TuneEval::data_load_print_interval / data_load_thread_count;
-                for(auto& fen : thread_batch)
+                // Rows sharing a hash are nearly always equal, a collision only costs a few extra comparisons
+                leaders[index] = index;
+                for (auto candidate = run_start; candidate < position; candidate++)
                 {
-                    parse_fen(side_to_move_wdl, parameters, entries, fen);
-                    position_count++;
-                    if (thread_id == 0 && position_count % thread_data_load_print_interval == 0)
+                    const auto other = shard[candidate];
+                    if (leaders[other] == other && rows_equal(entries, other, index))
                     {
-                        print_elapsed(time_start);
-                        std::cout << "Parsed ~" << position_count * data_load_thread_count << " positions..." << endl;
+                        leaders[index] = other;
+                        break;
                     }
                 }
             }
+            vector<size_t>().swap(shard);
+        }
+    });
+
+    // A group that outgrows the 16 bit weight continues in a fresh entry
+    Dataset merged;
+    vector<size_t> merged_indices(count);
+    vector<double> weights;
+    vector<double> wdl_sums;
+    vector<double> wdl_square_sums;
+    for (size_t i = 0; i < count; i++)
+    {
+        const auto weight = static_cast<double>(entries.headers[i].weight);
+        if (leaders[i] == i || weights[merged_indices[leaders[i]]] + weight > max_entry_weight)
+        {
+            merged_indices[leaders[i]] = merged.size();
+            merged.push_back(entries[i]);
+            weights.push_back(0);
+            wdl_sums.push_back(0);
+            wdl_square_sums.push_back(0);
+        }
 
-            thread_entries[thread_id] = entries;
-        });
+        const auto merged_index = merged_indices[leaders[i]];
+        const auto wdl = static_cast<double>(get_header_wdl(entries.headers[i]));
+        weights[merged_index] += weight;
+        wdl_sums[merged_index] += weight * wdl;
+        wdl_square_sums[merged_index] += weight * wdl * wdl;
     }
 
-    thread_pool.wait_for_completion();
+    merged.weight_sum = 0;
+    merged.error_offset = entries.error_offset;
+    merged.result_counts = entries.result_counts;
+    for (size_t i = 0; i < merged.size(); i++)
+    {
+        auto& header = merged.headers[i];
+        header.weight = static_cast<uint16_t>(weights[i]);
+        header.wdl = static_cast<float>(wdl_sums[i] / weights[i]);
+        const auto mean_wdl = static_cast<double>(get_header_wdl(header));
+        merged.weight_sum += header.weight;
+        merged.error_offset += wdl_square_sums[i] - weights[i] * mean_wdl * mean_wdl;
+    }
 
-    for (int thread_id = 0; thread_id < data_load_thread_count; thread_id++)
+    entries = std::move(merged);
+}
+
+static tune_t get_average_error(ThreadPool& thread_pool, const Dataset& entries, const parameters_t& parameters, tune_t K)
+{
+    vector<KahanSum> lane_errors(thread_pool.parallel_for_lanes());
+    thread_pool.parallel_for(0, entries.size(), entry_chunk_size, [&lane_errors, &entries, &parameters, K](const size_t start, const size_t end, const uint32_t lane)
     {
-        for(const Entry& entry : thread_entries[thread_id])
+        auto& error = lane_errors[lane];
+        for (auto i = start; i < end; i++)
         {
-            entries.push_back(entry);
+            const auto entry = entries[i];
+            const auto eval = linear_eval(entry, parameters);
+            const auto sig = sigmoid(K, eval);
+            const auto diff = entry.wdl - sig;
+            const auto entry_error = entry.weight * pow(diff, 2);
+            error.add(entry_error);
         }
+    });
+
+    KahanSum total_error;
+    for (const auto& error : lane_errors)
+    {
+        total_error.add(error.get());
     }
+
+    const tune_t avg_error = (total_error.get() + static_cast<tune_t>(entries.error_offset)) / static_cast<tune_t>(entries.weight_sum);
+    return avg_error;
 }
 
-static void load_fens(ThreadPool& thread_pool, const DataSource& source, const parameters_t& parameters, const high_resolution_clock::time_point start, vector<Entry>& entries)
+// Evaluates every entry once, the eval does not depend on K so the K search can reuse these
+static void get_cached_evals(ThreadPool& thread_pool, const Dataset& entries, const parameters_t& parameters, vector<tune_t>& evals)
 {
-    vector<string> fens;
-    read_fens(source, start, fens);
-    parse_fens(thread_pool, source, fens, parameters, start, entries);
+    evals.resize(entries.size());
+    thread_pool.parallel_for(0, entries.size(), entry_chunk_size, [&entries, &parameters, &evals](const size_t start, const size_t end, const uint32_t)
+    {
+        for (auto i = start; i < end; i++)
+        {
+            evals[i] = linear_eval(entries[i], parameters);
+        }
+    });
 }
 
-static tune_t sigmoid(const tune_t K, const tune_t eval)
+struct KDerivatives
 {
-    return static_cast<tune_t>(1) / (static_cast<tune_t>(1) + exp(-K * eval / static_cast<tune_t>(400)));
-}
+    tune_t error;
+    tune_t first;
+    tune_t second;
+};
 
-static tune_t get_average_error(ThreadPool& thread_pool, const vector<Entry>& entries, const parameters_t& parameters, tune_t K)
+// Average error at K and its analytic first and second derivatives with respect to K
+static KDerivatives get_k_derivatives(ThreadPool& thread_pool, const Dataset& entries, const vector<tune_t>& evals, const tune_t K)
 {
-    array<tune_t, thread_count> thread_errors;
-    for(int thread_id = 0; thread_id < thread_count; thread_id++)
+    vector<KDerivatives> lane_derivatives(thread_pool.parallel_for_lanes());
+    thread_pool.parallel_for(0, entries.size(), entry_chunk_size, [&lane_derivatives, &entries, &evals, K](const size_t start, const size_t end, const uint32_t lane)
     {
-        thread_pool.enqueue([thread_id, &thread_errors, &entries, &parameters, K]()
+        auto& derivatives = lane_derivatives[lane];
+        for (auto i = start; i < end; i++)
         {
-            const auto entries_per_thread = entries.size() / thread_count;
-            const auto start = static_cast<int>(thread_id * entries_per_thread);
-            const auto end = static_cast<int>((thread_id + 1) * entries_per_thread - 1);
-            tune_t error = 0;
-            for (int i = start; i < end; i++)
-            {
-                const auto& entry = entries[i];
-                const auto eval = linear_eval(entry, parameters);
-                const auto sig = sigmoid(K, eval);
-                const auto diff = entry.wdl - sig;
-                const auto entry_error = pow(diff, 2);
-                error += entry_error;
-            }
-            thread_errors[thread_id] = error;
-        });
-    }
-
-    thread_pool.wait_for_completion();
+            // With x = eval / 400 and s = sigmoid(K * x): ds/dK = s * (1 - s) * x, d2s/dK2 = ds/dK * (1 - 2 * s) * x
+            const auto x = evals[i] / static_cast<tune_t>(400);
+            const auto sig = sigmoid(K, evals[i]);
+            const auto& header = entries.headers[i];
+            const auto weight = static_cast<tune_t>(header.weight);
+            const auto diff = get_header_wdl(header) - sig;
+            const auto slope = sig * (1 - sig) * x;
+            derivatives.error += weight * diff * diff;
+            derivatives.first += weight * -2 * diff * slope;
+            derivatives.second += weight * 2 * (slope * slope - diff * slope * (1 - 2 * sig) * x);
+        }
+    });
 
-    tune_t total_error = 0;
-    for (int thread_id = 0; thread_id < thread_count; thread_id++)
+    KDerivatives total{};
+    for (const auto& derivatives : lane_derivatives)
     {
-        total_error += thread_errors[thread_id];
+        total.error += derivatives.error;
+        total.first += derivatives.first;
+        total.second += derivatives.second;
     }
 
-    const tune_t avg_error = total_error / static_cast<tune_t>(entries.size());
-    return avg_error;
+    const auto count = static_cast<tune_t>(entries.weight_sum);
+    return KDerivatives{ (total.error + static_cast<tune_t>(entries.error_offset)) / count, total.first / count, total.second / count };
 }
 
-static tune_t find_optimal_k(ThreadPool& thread_pool, const vector<Entry>& entries, const parameters_t& parameters)
+static tune_t find_optimal_k(ThreadPool& thread_pool, const Dataset& entries, const parameters_t& parameters)
 {
     constexpr tune_t rate = 10;
-    constexpr tune_t delta = 1e-5;
     constexpr tune_t deviation_goal = 1e-6;
+    constexpr int32_t max_iterations = 100;
     tune_t K = 2.5;
-    tune_t deviation = 1;
 
-    while (fabs(deviation) > deviation_goal)
+    vector<tune_t> evals;
+    get_cached_evals(thread_pool, entries, parameters, evals);
+
+    // Newton's method on the cached evals, falling back to a plain gradient step wherever the error is not convex in K.
+    // A step that increases the error is halved until it does not
+    tune_t previous_K = K;
+    tune_t previous_error = numeric_limits<tune_t>::max();
+    for (int32_t iteration = 0; iteration < max_iterations; iteration++)
     {
-        const tune_t up = get_average_error(thread_pool, entries, parameters, K + delta);
-        const tune_t down = get_average_error(thread_pool, entries, parameters, K - delta);
-        deviation = (up - down) / (2 * delta);
-        cout << "Current K: " << K << ", up: " << up << ", down: " << down << ", deviation: " << deviation << endl;
-        K -= deviation * rate;
+        const auto derivatives = get_k_derivatives(thread_pool, entries, evals, K);
+        cout << "Current K: " << K << ", error: " << derivatives.error << ", deviation: " << derivatives.first << endl;
+        if (derivatives.error > previous_error)
+        {
+            K = (K + previous_K) / 2;
+            continue;
+        }
+
+        if (fabs(derivatives.first) <= deviation_goal)
+        {
+            break;
+        }
+
+        previous_K = K;
+        previous_error = derivatives.error;
+        if (derivatives.second > 0)
+        {
+            K -= derivatives.first / derivatives.second;
+        }
+        else
+        {
+            K -= derivatives.first * rate;
+        }
     }
 
     return K;
 }
 
-static void update_single_gradient(parameters_t& gradient, const Entry& entry, const parameters_t& params, tune_t K) {
+// Adds the entry's gradient and returns its weighted squared error, which falls out of the same eval for free
+static tune_t update_single_gradient(parameters_t& gradient, const Entry& entry, const parameters_t& params, tune_t K) {
 
     const tune_t eval = linear_eval(entry, params);
     const tune_t sig = sigmoid(K, eval);
-    const tune_t res = (entry.wdl - sig) * sig * (1 - sig);
+    const tune_t diff = entry.wdl - sig;
+    const tune_t res = entry.weight * diff * sig * (1 - sig);
 
 #if TAPERED
-    const auto mg_base = res * (entry.phase / static_cast<tune_t>(24));
-    const auto eg_base = res - mg_base;
+    const auto& weights = phase_weights[entry.phase];
+    add_coefficients(entry.coefficients, res * weights.midgame, res * weights.endgame * entry.endgame_scale, gradient);
+#else
+    add_coefficients(entry.coefficients, res, gradient);
 #endif
 
-    for (const auto& coefficient : entry.coefficients)
+    return entry.weight * diff * diff;
+}
+
+using thread_gradients_t = array<parameters_t, thread_count>;
+using gradient_totals_t = array<vector<KahanSum>, thread_count>;
+
+// A float slot that keeps accumulating tens of thousands of entries loses most of their low bits. In single precision
+// every worker folds its gradient buffer into compensated per-thread totals after at most this many entries
+static constexpr bool compensate_gradients = is_same_v<tune_t, float>;
+static constexpr size_t gradient_fold_interval = 4 * entry_chunk_size;
+static constexpr size_t gradient_lanes_per_parameter = sizeof(parameters_t::value_type) / sizeof(tune_t);
+
+static void fold_gradient(parameters_t& gradient, vector<KahanSum>& totals)
+{
+    const auto lanes = reinterpret_cast<tune_t*>(gradient.data());
+    for (size_t lane = 0; lane < totals.size(); lane++)
     {
-#if TAPERED
-        gradient[coefficient.index][static_cast<int32_t>(PhaseStages::Midgame)] += mg_base * coefficient.value;
-        gradient[coefficient.index][static_cast<int32_t>(PhaseStages::Endgame)] += eg_base * coefficient.value * entry.endgame_scale;
-#else
-        gradient[coefficient.index] += res * coefficient.value;
-#endif
+        totals[lane].add(lanes[lane]);
+        lanes[lane] = 0;
     }
 }
 
-static void compute_gradient(ThreadPool& thread_pool, parameters_t& gradient, const vector<Entry>& entries, const parameters_t& params, tune_t K)
+// Sum of one gradient lane, a parameter or one phase of a tapered parameter, across all threads
+static tune_t sum_gradient_lane(const thread_gradients_t& thread_gradients, const gradient_totals_t& gradient_totals, const size_t lane)
 {
-    array<parameters_t, thread_count> thread_gradients;
-    for(int thread_id = 0; thread_id < thread_count; thread_id++)
+    if constexpr (compensate_gradients)
     {
-        thread_pool.enqueue([thread_id, &thread_gradients, &entries, &params, K]()
+        KahanSum sum;
+        for (const auto& totals : gradient_totals)
         {
-            const auto entries_per_thread = entries.size() / thread_count;
-            const auto start = static_cast<int>(thread_id * entries_per_thread);
-            const auto end = static_cast<int>((thread_id + 1) * entries_per_thread - 1);
-#if TAPERED
-            parameters_t gradient = parameters_t(params.size(), pair_t{});
-#else
-            parameters_t gradient = parameters_t(params.size(), 0);
-#endif
-            for (int i = start; i < end; i++)
-            {
-                const auto& entry = entries[i];
-                update_single_gradient(gradient, entry, params, K);
-            }
-            thread_gradients[thread_id] = gradient;
-        });
+            sum.add(totals[lane].sum);
+            sum.add(-totals[lane].compensation);
+        }
+        return sum.get();
+    }
+    else
+    {
+        tune_t sum = 0;
+        for (const auto& gradient : thread_gradients)
+        {
+            sum += reinterpret_cast<const tune_t*>(gradient.data())[lane];
+        }
+        return sum;
     }
+}
 
-    thread_pool.wait_for_completion();
+struct AdamState
+{
+    parameters_t momentum;
+    parameters_t velocity;
+    tune_t learning_rate;
+};
 
-    for (int thread_id = 0; thread_id < thread_count; thread_id++)
+// Adam update of one parameter (or one phase of a tapered parameter) from its summed gradient
+static void adam_update(tune_t& parameter, tune_t& momentum, tune_t& velocity, const tune_t gradient_sum, const tune_t gradient_scale, const tune_t learning_rate)
+{
+    constexpr tune_t beta1 = 0.9;
+    constexpr tune_t beta2 = 0.999;
+
+    const tune_t grad = gradient_scale * gradient_sum;
+    momentum = beta1 * momentum + (1 - beta1) * grad;
+    velocity = beta2 * velocity + (1 - beta2) * pow(grad, 2);
+    parameter -= learning_rate * momentum / (static_cast<tune_t>(1e-8) + sqrt(velocity));
+}
+
+struct EpochResult
+{
+    tune_t error;
+    double busy_min_ms;
+    double busy_average_ms;
+    double busy_max_ms;
+};
+
+// Runs one epoch and returns the average error of the parameters before the update, along with how long each worker spent
+// on the gradient pass. Entries vary a lot in coefficient count, so the workers claim small chunks of entries from a shared
+// cursor instead of taking fixed slices, and each accumulates into its own reused buffer. After a barrier,
+// every worker reduces one slice of the parameter range across all buffers and applies the Adam update to it,
+// so neither the reduction nor the update runs on a single thread
+static EpochResult run_epoch(EpochWorkers& epoch_workers, thread_gradients_t& thread_gradients, gradient_totals_t& gradient_totals, const Dataset& entries, parameters_t& params, AdamState& adam, const tune_t K)
+{
+    array<KahanSum, thread_count> thread_errors;
+    array<double, thread_count> thread_busy_ms;
+    atomic<size_t> next_entry = 0;
+    const tune_t gradient_scale = -K / static_cast<tune_t>(400) / static_cast<tune_t>(entries.weight_sum);
+    auto epoch_job = [&epoch_workers, &thread_gradients, &gradient_totals, &thread_errors, &thread_busy_ms, &next_entry, &entries, &params, &adam, K, gradient_scale](const uint32_t thread_id)
     {
-        for(auto parameter_index = 0; parameter_index < params.size(); parameter_index++)
+        const auto busy_start = high_resolution_clock::now();
+        auto& thread_gradient = thread_gradients[thread_id];
+        auto& thread_totals = gradient_totals[thread_id];
+        fill(thread_gradient.begin(), thread_gradient.end(), parameters_t::value_type{});
+        fill(thread_totals.begin(), thread_totals.end(), KahanSum{});
+
+        KahanSum error;
+        size_t unfolded_entries = 0;
+        while (true)
         {
-#if TAPERED
-            gradient[parameter_index][static_cast<int32_t>(PhaseStages::Midgame)] += thread_gradients[thread_id][parameter_index][static_cast<int32_t>(PhaseStages::Midgame)];
-            gradient[parameter_index][static_cast<int32_t>(PhaseStages::Endgame)] += thread_gradients[thread_id][parameter_index][static_cast<int32_t>(PhaseStages::Endgame)];
-#else
-            gradient[parameter_index] += thread_gradients[thread_id][parameter_index];
-#endif
+            const auto start = next_entry.fetch_add(entry_chunk_size, memory_order_relaxed);
+            if (start >= entries.size())
+            {
+                break;
+            }
+
+            const auto end = min(start + entry_chunk_size, entries.size());
+            for (auto i = start; i < end; i++)
+            {
+                const auto entry = entries[i];
+                error.add(update_single_gradient(thread_gradient, entry, params, K));
+            }
+
+            unfolded_entries += end - start;
+            if (compensate_gradients && unfolded_entries >= gradient_fold_interval)
+            {
+                fold_gradient(thread_gradient, thread_totals);
+                unfolded_entries = 0;
+            }
+        }
+        if constexpr (compensate_gradients)
+        {
+            fold_gradient(thread_gradient, thread_totals);
+        }
+        thread_errors[thread_id] = error;
+        thread_busy_ms[thread_id] = duration<double, milli>(high_resolution_clock::now() - busy_start).count();
+
+        // Every gradient has to be complete, and nobody may still be reading the parameters, before they get updated
+        epoch_workers.sync();
+
+        const auto lane_start = thread_id * params.size() / thread_count * gradient_lanes_per_parameter;
+        const auto lane_end = (thread_id + 1) * params.size() / thread_count * gradient_lanes_per_parameter;
+        const auto parameter_lanes = reinterpret_cast<tune_t*>(params.data());
+        const auto momentum_lanes = reinterpret_cast<tune_t*>(adam.momentum.data());
+        const auto velocity_lanes = reinterpret_cast<tune_t*>(adam.velocity.data());
+        for (auto lane = lane_start; lane < lane_end; lane++)
+        {
+            const auto gradient_sum = sum_gradient_lane(thread_gradients, gradient_totals, lane);
+            adam_update(parameter_lanes[lane], momentum_lanes[lane], velocity_lanes[lane], gradient_sum, gradient_scale, adam.learning_rate);
         }
+    };
+    epoch_workers.run(epoch_job);
+
+    KahanSum total_error;
+    double total_busy_ms = 0;
+    for (int thread_id = 0; thread_id < thread_count; thread_id++)
+    {
+        total_error.add(thread_errors[thread_id].get());
+        total_busy_ms += thread_busy_ms[thread_id];
     }
+
+    EpochResult result;
+    result.error = (total_error.get() + static_cast<tune_t>(entries.error_offset)) / static_cast<tune_t>(entries.weight_sum);
+    result.busy_min_ms = *min_element(thread_busy_ms.begin(), thread_busy_ms.end());
+    result.busy_average_ms = total_busy_ms / thread_count;
+    result.busy_max_ms = *max_element(thread_busy_ms.begin(), thread_busy_ms.end());
+    return result;
 }
 
-void Tuner::run(const std::vector<DataSource>& sources)
+// Loads the sources and tunes for TuneEval::max_epoch epochs. A benchmark run skips the periodic parameter printing
+static parameters_t tune(const vector<DataSource>& sources, const bool benchmark, double& final_epochs_per_second)
 {
     cout << "Starting tuning" << endl << endl;
     const auto start = high_resolution_clock::now();
@@ -823,11 +2947,12 @@ void Tuner::run(const std::vector<DataSource>& sources)
     cout << "Getting initial parameters..." << endl;
     auto parameters = TuneEval::get_initial_parameters();
     cout << "Got " << parameters.size() << " parameters" << endl;
+    check_parameter_count(parameters.size());
 
     cout << "Initial parameters:" << endl;
     TuneEval::print_parameters(parameters);
 
-    vector<Entry> entries;
+    Dataset entries;
 
     // Debug entry
     //const string debug_fen = "rnb1kbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQK1NR w KQkq - 0 1; 1.0";
@@ -838,10 +2963,49 @@ void Tuner::run(const std::vector<DataSource>& sources)
     //debug_entry.initial_eval = linear_eval(debug_entry, parameters);
     //entries.push_back(debug_entry);
 
-    vector<string> fens;
-    for (const auto& source : sources)
+    // Pipes cannot be hashed without consuming them, so they are never cached
+    const bool has_pipe_source = any_of(sources.begin(), sources.end(), [](const DataSource& source)
+    {
+        return StreamedFile::is_pipe(source.path);
+    });
+    const bool cache_data = use_data_cache && !has_pipe_source;
+    if (use_data_cache && has_pipe_source)
+    {
+        cout << "Data cache disabled, some data sources are pipes" << endl;
+    }
+
+    uint64_t data_cache_key = 0;
+    string data_cache_path;
+    bool loaded_from_cache = false;
+    if (cache_data)
+    {
+        cout << "Hashing data sources..." << endl;
+        data_cache_key = get_data_cache_key(sources, parameters);
+        data_cache_path = get_data_cache_path(data_cache_key);
+        loaded_from_cache = load_data_cache(data_cache_path, data_cache_key, entries);
+        if (loaded_from_cache)
+        {
+            print_elapsed(start);
+            cout << "Loaded " << entries.size() << " entries from data cache " << data_cache_path << endl;
+        }
+    }
+
+    if (!loaded_from_cache)
     {
-        load_fens(thread_pool, source, parameters, start, entries);
+        load_fens(thread_pool, sources, parameters, start, entries);
+
+        if constexpr (merge_duplicate_entries)
+        {
+            const auto entry_count = entries.size();
+            merge_duplicate_rows(thread_pool, entries);
+            print_elapsed(start);
+            cout << "Merged " << entry_count << " entries (" << entries.weight_sum << " positions) into " << entries.size() << " weighted entries" << endl;
+        }
+
+        if (cache_data)
+        {
+            save_data_cache(data_cache_path, data_cache_key, entries);
+        }
     }
     cout << "Data loading complete" << endl << endl;
 
@@ -880,62 +3044,304 @@ void Tuner::run(const std::vector<DataSource>& sources)
     cout << "Initial error = " << avg_error << endl;
 
     const auto loop_start = high_resolution_clock::now();
-    tune_t learning_rate = TuneEval::initial_learning_rate;
     int32_t max_tune_epoch = TuneEval::max_epoch;
+    AdamState adam;
+    adam.learning_rate = TuneEval::initial_learning_rate;
+    adam.momentum.resize(parameters.size());
+    adam.velocity.resize(parameters.size());
+    EpochWorkers epoch_workers(thread_count);
+    thread_gradients_t thread_gradients;
+    for (auto& thread_gradient : thread_gradients)
+    {
+        thread_gradient.resize(parameters.size());
+    }
+    gradient_totals_t gradient_totals;
+    if constexpr (compensate_gradients)
+    {
+        for (auto& thread_totals : gradient_totals)
+        {
+            thread_totals.resize(parameters.size() * gradient_lanes_per_parameter);
+        }
+    }
+
+    for (int32_t epoch = 1; epoch < max_tune_epoch; epoch++)
+    {
+        // The error belongs to the parameters before this epoch's update
+        const auto epoch_result = run_epoch(epoch_workers, thread_gradients, gradient_totals, entries, parameters, adam, K);
+
+        const bool print_parameters = !benchmark && epoch % 100 == 0;
+        if (print_parameters)
+        {
+            system("cls");
+        }
+
+        const auto elapsed_ms = duration_cast<milliseconds>(high_resolution_clock::now() - loop_start).count();
+        const auto epochs_per_second = epoch * 1000.0 / max<int64_t>(elapsed_ms, 1);
+        final_epochs_per_second = epochs_per_second;
+        print_elapsed(start);
+        cout << "Epoch " << epoch << " (" << epochs_per_second << " eps), error " << epoch_result.error << ", LR " << adam.learning_rate;
+        cout << ", busy min/avg/max " << epoch_result.busy_min_ms << "/" << epoch_result.busy_average_ms << "/" << epoch_result.busy_max_ms << " ms" << endl;
+
+        if (print_parameters)
+        {
+            TuneEval::print_parameters(parameters);
+        }
+
+        if(epoch % TuneEval::learning_rate_drop_interval == 0)
+        {
+            adam.learning_rate *= TuneEval::learning_rate_drop_ratio;
+        }
+    }
+
+    thread_pool.stop();
+    return parameters;
+}
+
+void Tuner::run(const std::vector<DataSource>& sources)
+{
+    double epochs_per_second = 0;
+    tune(sources, false, epochs_per_second);
+}
+
+static const char* get_precision_name()
+{
+    return sizeof(tune_t) == sizeof(float) ? "float" : "double";
+}
+
+// Benchmark results are text: the epochs per second, then every parameter lane at full precision
+static void save_benchmark_result(const string& path, const double epochs_per_second, const parameters_t& parameters)
+{
+    ofstream file(path);
+    file << setprecision(numeric_limits<double>::max_digits10) << epochs_per_second << '\n';
+    for (const auto& parameter : parameters)
+    {
 #if TAPERED
-    parameters_t momentum(parameters.size(), pair_t{});
-    parameters_t velocity(parameters.size(), pair_t{});
+        file << static_cast<double>(parameter[0]) << ' ' << static_cast<double>(parameter[1]) << '\n';
 #else
-    parameters_t momentum(parameters.size(), 0);
-    parameters_t velocity(parameters.size(), 0);
+        file << static_cast<double>(parameter) << '\n';
 #endif
-    for (int32_t epoch = 1; epoch < max_tune_epoch; epoch++)
+    }
+    if (!file)
+    {
+        cout << "Failed to write benchmark result " << path << endl;
+    }
+}
+
+static bool load_benchmark_result(const string& path, double& epochs_per_second, vector<double>& values)
+{
+    ifstream file(path);
+    if (!(file >> epochs_per_second))
+    {
+        return false;
+    }
+
+    double value;
+    while (file >> value)
+    {
+        values.push_back(value);
+    }
+    return true;
+}
+
+void Tuner::benchmark(const std::vector<DataSource>& sources, const std::string& result_path, const std::string& reference_path)
+{
+    double epochs_per_second = 0;
+    const auto parameters = tune(sources, true, epochs_per_second);
+    save_benchmark_result(result_path, epochs_per_second, parameters);
+    cout << "Benchmark (" << get_precision_name() << "): " << epochs_per_second << " eps over " << TuneEval::max_epoch - 1 << " epochs, parameters written to " << result_path << endl;
+
+    if (reference_path.empty())
+    {
+        return;
+    }
+
+    double reference_epochs_per_second;
+    vector<double> reference_values;
+    if (!load_benchmark_result(reference_path, reference_epochs_per_second, reference_values))
+    {
+        cout << "Failed to read benchmark reference " << reference_path << endl;
+        return;
+    }
+
+    vector<double> values;
+    for (const auto& parameter : parameters)
     {
 #if TAPERED
-        parameters_t gradient(parameters.size(), pair_t{});
+        values.push_back(parameter[0]);
+        values.push_back(parameter[1]);
 #else
-        parameters_t gradient(parameters.size(), 0);
+        values.push_back(parameter);
 #endif
-        
-        compute_gradient(thread_pool, gradient, entries, parameters, K);
+    }
+    if (values.size() != reference_values.size())
+    {
+        cout << "Benchmark reference " << reference_path << " has " << reference_values.size() << " parameter values, expected " << values.size() << endl;
+        return;
+    }
+
+    double max_deviation = 0;
+    double max_reference = 0;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        max_deviation = max(max_deviation, abs(values[i] - reference_values[i]));
+        max_reference = max(max_reference, abs(reference_values[i]));
+    }
+    cout << "Against " << reference_path << ": " << epochs_per_second / reference_epochs_per_second << "x the eps (" << reference_epochs_per_second << "), ";
+    cout << "max parameter deviation " << max_deviation << " (largest parameter " << max_reference << ")" << endl;
+}
 
-        constexpr tune_t beta1 = 0.9;
-        constexpr tune_t beta2 = 0.999;
+#if TAPERED
+static constexpr int32_t self_check_lanes = 2;
+#else
+static constexpr int32_t self_check_lanes = 1;
+#endif
 
-        for (int parameter_index = 0; parameter_index < parameters.size(); parameter_index++) {
+static tune_t& get_parameter_lane(parameters_t& parameters, const uint32_t index, const int32_t lane)
+{
 #if TAPERED
-            for(int phase_stage = 0; phase_stage < 2; phase_stage++)
+    return parameters[index][lane];
+#else
+    (void)lane;
+    return parameters[index];
+#endif
+}
+
+bool Tuner::self_check()
+{
+    constexpr uint32_t parameter_count = 1000;
+    constexpr int32_t row_count = 100000;
+    constexpr size_t max_row_size = 80;
+    constexpr auto epsilon = numeric_limits<tune_t>::epsilon();
+
+    mt19937_64 random(sampling_seed);
+    uniform_real_distribution<tune_t> parameter_distribution(-300, 300);
+    uniform_real_distribution<tune_t> base_distribution(-1, 1);
+    uniform_int_distribution<int32_t> value_distribution(-CoefficientEntry::max_value, CoefficientEntry::max_value);
+
+    parameters_t parameters(parameter_count);
+    for (uint32_t index = 0; index < parameter_count; index++)
+    {
+        for (int32_t lane = 0; lane < self_check_lanes; lane++)
+        {
+            get_parameter_lane(parameters, index, lane) = parameter_distribution(random);
+        }
+    }
+
+    parameters_t gradient(parameter_count);
+    parameters_t magnitudes(parameter_count);
+    vector<CoefficientEntry> row;
+    tune_t max_deviation = 0;
+    int64_t mismatch_count = 0;
+    const auto check = [&](const tune_t actual, const tune_t expected, const tune_t magnitude)
+    {
+        // Both sides round every term, so they may each be off by up to one rounding per term of the magnitude
+        const auto deviation = abs(actual - expected);
+        if (deviation > 2 * (row.size() + 1) * epsilon * magnitude)
+        {
+            mismatch_count++;
+        }
+        if (magnitude > 0)
+        {
+            max_deviation = max(max_deviation, deviation / magnitude);
+        }
+    };
+
+    for (int32_t row_index = 0; row_index < row_count; row_index++)
+    {
+        // Every length up to max_row_size covers all vector tails. Counts beyond max_value are split into several
+        // entries of one index, which puts repeated indices within a vector and hits the scatter's conflict fallback
+        row.clear();
+        const auto row_size = static_cast<size_t>(random() % (max_row_size + 1));
+        while (row.size() < row_size)
+        {
+            const auto index = static_cast<uint32_t>(random() % parameter_count);
+            if (random() % 8 == 0)
+            {
+                const auto split_count = 2 + random() % 3;
+                const auto split_value = random() % 2 == 0 ? CoefficientEntry::max_value : -CoefficientEntry::max_value;
+                for (size_t split = 0; split < split_count && row.size() < row_size; split++)
+                {
+                    row.emplace_back(split_value, index);
+                }
+                continue;
+            }
+
+            const auto value = value_distribution(random);
+            row.emplace_back(value != 0 ? value : 1, index);
+        }
+
+        array<tune_t, self_check_lanes> expected_sums{};
+        array<tune_t, self_check_lanes> sum_magnitudes{};
+        for (const auto& coefficient : row)
+        {
+            for (int32_t lane = 0; lane < self_check_lanes; lane++)
             {
-                const tune_t grad = -K / static_cast<tune_t>(400) * gradient[parameter_index][phase_stage] / static_cast<tune_t>(entries.size());
-                momentum[parameter_index][phase_stage] = beta1 * momentum[parameter_index][phase_stage] + (1 - beta1) * grad;
-                velocity[parameter_index][phase_stage] = beta2 * velocity[parameter_index][phase_stage] + (1 - beta2) * pow(grad, 2);
-                parameters[parameter_index][phase_stage] -= learning_rate * momentum[parameter_index][phase_stage] / (static_cast<tune_t>(1e-8) + sqrt(velocity[parameter_index][phase_stage]));
+                const auto term = coefficient.value() * get_parameter_lane(parameters, coefficient.index(), lane);
+                expected_sums[lane] += term;
+                sum_magnitudes[lane] += abs(term);
             }
+        }
+        const auto sums = sum_coefficients(row, parameters);
+#if TAPERED
+        check(sums.midgame, expected_sums[0], sum_magnitudes[0]);
+        check(sums.endgame, expected_sums[1], sum_magnitudes[1]);
 #else
-            const tune_t grad = -K / 400.0 * gradient[parameter_index] / static_cast<tune_t>(entries.size());
-            momentum[parameter_index] = beta1 * momentum[parameter_index] + (1 - beta1) * grad;
-            velocity[parameter_index] = beta2 * velocity[parameter_index] + (1 - beta2) * pow(grad, 2);
-            parameters[parameter_index] -= learning_rate * momentum[parameter_index] / (1e-8 + sqrt(velocity[parameter_index]));
+        check(sums, expected_sums[0], sum_magnitudes[0]);
 #endif
-            
-        }
 
-        if (epoch % 100 == 0)
+        array<tune_t, self_check_lanes> bases;
+        for (auto& base : bases)
         {
-            system("cls");
-            const auto elapsed_ms = duration_cast<milliseconds>(high_resolution_clock::now() - loop_start).count();
-            const auto epochs_per_second = epoch * 1000.0 / elapsed_ms;
-            const tune_t error = get_average_error(thread_pool, entries, parameters, K);
-            print_elapsed(start);
-            cout << "Epoch " << epoch << " (" << epochs_per_second << " eps), error " << error << ", LR " << learning_rate << endl;
-            TuneEval::print_parameters(parameters);
+            base = base_distribution(random);
         }
+#if TAPERED
+        add_coefficients(row, bases[0], bases[1], gradient);
+#else
+        add_coefficients(row, bases[0], gradient);
+#endif
 
-        if(epoch % TuneEval::learning_rate_drop_interval == 0)
+        // The expected gradient is built in magnitudes' place, then checked and cleared for the next row
+        for (const auto& coefficient : row)
         {
-            learning_rate *= TuneEval::learning_rate_drop_ratio;
+            for (int32_t lane = 0; lane < self_check_lanes; lane++)
+            {
+                get_parameter_lane(magnitudes, coefficient.index(), lane) += abs(bases[lane] * coefficient.value());
+            }
+        }
+        for (const auto& coefficient : row)
+        {
+            for (int32_t lane = 0; lane < self_check_lanes; lane++)
+            {
+                auto& magnitude = get_parameter_lane(magnitudes, coefficient.index(), lane);
+                if (magnitude == 0)
+                {
+                    continue;
+                }
+
+                tune_t expected = 0;
+                for (const auto& other : row)
+                {
+                    if (other.index() == coefficient.index())
+                    {
+                        expected += bases[lane] * other.value();
+                    }
+                }
+                auto& actual = get_parameter_lane(gradient, coefficient.index(), lane);
+                check(actual, expected, magnitude);
+                actual = 0;
+                magnitude = 0;
+            }
         }
     }
 
-    thread_pool.stop();
+#if TUNER_SIMD == 512
+    const char* const kernels = "AVX-512";
+#elif TUNER_SIMD == 256
+    const char* const kernels = "AVX2";
+#else
+    const char* const kernels = "scalar";
+#endif
+    cout << "Kernel self-check (" << kernels << ", " << (sizeof(tune_t) == sizeof(float) ? "float" : "double") << "): ";
+    cout << row_count << " rows, max relative deviation " << max_deviation << ", " << mismatch_count << " mismatches" << endl;
+    return mismatch_count == 0;
 }
@@ -7,14 +7,34 @@
 
 namespace Tuner
 {
+    // How position_limit picks the positions of a source
+    enum class SamplingMode
+    {
+        // The first position_limit lines
+        Prefix = 0,
+        // A uniform random sample of position_limit lines
+        Random = 1,
+        // A random sample with an equal share of positions from every game phase bucket
+        PhaseBalanced = 2
+    };
+
     struct DataSource
     {
         std::string path;
         bool side_to_move_wdl;
         int64_t position_limit;
+        SamplingMode sampling = SamplingMode::Prefix;
     };
 
     void run(const std::vector<DataSource>& sources);
+
+    // Tunes like run without printing parameters, then writes the epochs per second and the final parameters to
+    // result_path. With a reference_path written by an earlier benchmark, e.g. of the other precision, also reports
+    // the speedup over it and the largest parameter deviation from it
+    void benchmark(const std::vector<DataSource>& sources, const std::string& result_path, const std::string& reference_path);
+
+    // Runs the SIMD kernels of this build against plain loops on random coefficient rows, returns whether they agree
+    bool self_check();
 }
 
 #endif // !TUNER_H